@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -23,33 +23,260 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+// Buffers are found through a hash table keyed by device and
+// block number. Each bucket has its own lock, so lookups and
+// releases of blocks in different buckets don't contend.
+//
+// The buffers themselves live in pages from kalloc(), BPP to
+// a page. binit() gives the cache 1/BUFDIV of free memory;
+// bget() adds pages when every buffer is in use, or to win
+// back pages that bshrink() returned to kalloc() when memory
+// was short. bshrink() leaves at least NBUF, which covers
+// the most the log can hold at once: a transaction's pinned
+// blocks, the commit's copies of them, and the next
+// transaction, each up to LOGSIZE.
+//
+// Replacement is 2Q, so that a scan through a big file can't
+// push out the blocks that are used again and again, such as
+// inodes, bitmaps and directories:
+// * a block read for the first time joins a FIFO of recent
+//   blocks (a1), which gets at most a quarter of the cache.
+// * when a block leaves a1, its number is remembered for a
+//   while in a ghost list (a1out).
+// * a block that is read again after that was evidently not
+//   just a scan: it goes into the main queue (am) instead,
+//   where a CLOCK approximates LRU. bfind() sets the buffer's
+//   ref bit on each hit, which takes no lock but the bucket's.
+// Moving buffers between buckets and queues, and adding and
+// removing buffers, happen under evictlock.
+#define NBUCKET 251
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+#define BPP     ((int)(PGSIZE / sizeof(struct buf)))
+#define NBPAGE  4096
+#define NGHOST  1024
+#define MAXRUN  16      // blocks per read-ahead request
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;       // Buffers in the bucket, through next
+};
+
+struct {
+  struct spinlock evictlock;
+  struct bucket bucket[NBUCKET];
+
+  // evictlock protects the rest.
+  char *page[NBPAGE];     // Pages of buffers, 0 if free
+  int nbuf;
+  int target;             // Size to grow back to, in buffers
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct buf *a1;         // Oldest first-time buffer
+  int na1;
+  struct buf *am;         // Main queue, at the CLOCK hand
+  struct {
+    uint dev;
+    uint blockno;
+  } a1out[NGHOST];        // Ring of blocks evicted from a1
+  int ghost;              // Next a1out slot to use
 } bcache;
 
+// Queues are circular lists through qnext and qprev;
+// *q points at the head, or is 0 if the queue is empty.
+static void
+qpush(struct buf **q, struct buf *b)
+{
+  if(*q == 0){
+    b->qnext = b->qprev = b;
+    *q = b;
+  } else {
+    b->qnext = *q;
+    b->qprev = (*q)->qprev;
+    b->qprev->qnext = b;
+    (*q)->qprev = b;
+  }
+}
+
+static void
+qremove(struct buf **q, struct buf *b)
+{
+  if(b->qnext == b){
+    *q = 0;
+    return;
+  }
+  b->qprev->qnext = b->qnext;
+  b->qnext->qprev = b->qprev;
+  if(*q == b)
+    *q = b->qnext;
+}
+
+// Add a page of buffers to the cache, as unused buffers at
+// the head of a1, holding no block (block 0 of device 0,
+// which is never read). Caller holds evictlock.
+// Returns 0, or -1 if out of memory.
+static int
+bgrow(void)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(0, 0)];
+  struct buf *b;
+  char *pg;
+  int i;
+
+  for(i = 0; i < NBPAGE; i++)
+    if(bcache.page[i] == 0)
+      break;
+  if(i == NBPAGE || (pg = kalloc()) == 0)
+    return -1;
+  bcache.page[i] = pg;
+  memset(pg, 0, PGSIZE);
+
+  acquire(&bk->lock);
+  for(b = (struct buf*)pg; b < (struct buf*)pg + BPP; b++){
+    initsleeplock(&b->lock, "buffer");
+    b->next = bk->head;
+    bk->head = b;
+    qpush(&bcache.a1, b);
+    bcache.a1 = b;
+    bcache.na1++;
+  }
+  release(&bk->lock);
+  bcache.nbuf += BPP;
+  return 0;
+}
+
 void
 binit(void)
+{
+  struct bucket *bk;
+  int n;
+
+  initlock(&bcache.evictlock, "bcache");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+
+  n = kfreecount() / BUFDIV * BPP;
+  if(n < NBUF)
+    n = NBUF;
+  bcache.target = n;
+  acquire(&bcache.evictlock);
+  while(bcache.nbuf < n)
+    if(bgrow() < 0)
+      panic("binit");
+  release(&bcache.evictlock);
+}
+
+// Return the buffer in bucket bk for block blockno on device
+// dev, with a new reference, or 0. Caller holds bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
 {
   struct buf *b;
 
-  initlock(&bcache.lock, "bcache");
+  for(b = bk->head; b; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      b->refcnt++;
+      b->ref = 1;
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Take b out of the hash table, if no one is using it, and
+// no read-ahead into it is under way.
+// Caller holds evictlock, which keeps b in its bucket.
+// Returns 0, or -1 if b is in use.
+static int
+bclaim(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  struct buf **pp;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  acquire(&bk->lock);
+  if(b->refcnt != 0 || b->disk){
+    release(&bk->lock);
+    return -1;
+  }
+  for(pp = &bk->head; *pp != b; pp = &(*pp)->next)
+    ;
+  *pp = b->next;
+  release(&bk->lock);
+  return 0;
+}
+
+// Put b, which bclaim() took out, back in the hash table.
+static void
+bunclaim(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+}
+
+// Was block blockno of dev evicted from a1 not long ago?
+static int
+bghost(uint dev, uint blockno)
+{
+  int i;
+
+  for(i = 0; i < NGHOST; i++)
+    if(bcache.a1out[i].blockno == blockno && bcache.a1out[i].dev == dev)
+      return 1;
+  return 0;
+}
+
+// Take the buffer to recycle out of the hash table and its
+// queue. Caller holds evictlock. Returns 0 if every buffer
+// is in use.
+static struct buf*
+bvictim(void)
+{
+  struct buf *b;
+  int i, n;
+
+  // the oldest unused first-time block, once a1 has more
+  // than its share.
+  if(bcache.na1 > bcache.nbuf / 4 || bcache.am == 0){
+    for(b = bcache.a1, n = bcache.na1; n > 0; b = b->qnext, n--){
+      if(bclaim(b) == 0){
+        qremove(&bcache.a1, b);
+        bcache.na1--;
+        if(b->dev != 0){
+          bcache.a1out[bcache.ghost].dev = b->dev;
+          bcache.a1out[bcache.ghost].blockno = b->blockno;
+          bcache.ghost = (bcache.ghost + 1) % NGHOST;
+        }
+        return b;
+      }
+    }
   }
+
+  // CLOCK over am: pass over buffers hit since the hand last
+  // came by, clearing their ref bits. Two turns at most.
+  for(i = 0; bcache.am && i < 2 * bcache.nbuf; i++){
+    b = bcache.am;
+    bcache.am = b->qnext;
+    if(b->ref){
+      b->ref = 0;
+      continue;
+    }
+    if(bclaim(b) == 0){
+      qremove(&bcache.am, b);
+      return b;
+    }
+  }
+
+  // anything unused in a1.
+  for(b = bcache.a1, n = bcache.na1; n > 0; b = b->qnext, n--){
+    if(bclaim(b) == 0){
+      qremove(&bcache.a1, b);
+      bcache.na1--;
+      return b;
+    }
+  }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
@@ -58,34 +285,101 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
+  struct bucket *bk = &bcache.bucket[BHASH(dev, blockno)];
   struct buf *b;
 
-  acquire(&bcache.lock);
-
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    acquiresleep(&b->lock);
+    return b;
+  }
+
+  for(;;){
+    // Not cached. Look again once no one else is recycling a
+    // buffer, in case another hart just did so for this block.
+    acquire(&bcache.evictlock);
+    acquire(&bk->lock);
+    b = bfind(bk, dev, blockno);
+    release(&bk->lock);
+    if(b){
+      release(&bcache.evictlock);
       acquiresleep(&b->lock);
       return b;
     }
+
+    // grow back after bshrink(), if memory is plentiful again.
+    if(bcache.nbuf < bcache.target && kfreecount() > bcache.target / BPP)
+      bgrow();
+    if((b = bvictim()) != 0 || (bgrow() == 0 && (b = bvictim()) != 0))
+      break;
+
+    // every buffer is in use and memory is out: wait a tick
+    // for someone to release one.
+    release(&bcache.evictlock);
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
   }
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->ref = 0;
+  if((b->inam = bghost(dev, blockno)) != 0){
+    qpush(&bcache.am, b);
+  } else {
+    qpush(&bcache.a1, b);
+    bcache.na1++;
+  }
+  bunclaim(b);
+  release(&bcache.evictlock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Give a page of unused buffers back to kalloc(), because
+// memory is short. The cache will grow back to its size at
+// boot when there is memory again.
+// Returns 0, or -1 if there was no such page.
+int
+bshrink(void)
+{
+  struct buf *b;
+  int i, j;
+
+  acquire(&bcache.evictlock);
+  for(i = 0; i < NBPAGE && bcache.nbuf - BPP >= NBUF; i++){
+    if(bcache.page[i] == 0)
+      continue;
+    b = (struct buf*)bcache.page[i];
+    for(j = 0; j < BPP; j++)
+      if(bclaim(&b[j]) < 0)
+        break;
+    if(j < BPP){
+      while(--j >= 0)
+        bunclaim(&b[j]);
+      continue;
+    }
+    for(j = 0; j < BPP; j++){
+      if(b[j].inam){
+        qremove(&bcache.am, &b[j]);
+      } else {
+        qremove(&bcache.a1, &b[j]);
+        bcache.na1--;
+      }
     }
+    bcache.nbuf -= BPP;
+    bcache.page[i] = 0;
+    release(&bcache.evictlock);
+    kfree(b);
+    return 0;
   }
-  panic("bget: no buffers");
+  release(&bcache.evictlock);
+  return -1;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -96,7 +390,58 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    virtio_disk_wait(b);
+    if(!b->valid) {
+      virtio_disk_rw(b, 0);
+      b->valid = 1;
+    }
+  }
+  return b;
+}
+
+// Start reading the n blocks from blockno on into the cache,
+// without waiting for the disk; a later bread() waits if
+// need be. Blocks already in the cache are skipped, and each
+// run of the others goes to the disk as one request.
+// Returns 0, or -1 if the disk's queue is full.
+int
+breadahead(uint dev, uint blockno, int n)
+{
+  struct buf *b[MAXRUN];
+  int i, k = 0, r = 0;
+
+  for(i = 0; i <= n; i++){
+    if(i < n){
+      b[k] = bget(dev, blockno + i);
+      if(!b[k]->valid && k + 1 < MAXRUN){
+        k++;
+        continue;
+      }
+      if(!b[k]->valid)
+        k++;
+      else
+        brelse(b[k]);
+    }
+    // start the run so far.
+    if(k > 0 && r == 0)
+      r = virtio_disk_read_async(b, k);
+    while(k > 0)
+      brelse(b[--k]);
+  }
+  return r;
+}
+
+// Return a locked buf for the indicated block, for a caller
+// that is going to overwrite all of it, without reading it
+// from disk.
+struct buf*
+bgetblank(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if(!b->valid) {
+    virtio_disk_wait(b);
     b->valid = 1;
   }
   return b;
@@ -111,43 +456,51 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Write the contents of n bufs to disk, as one batch. Each
+// goes to blockno[i], or to its own block if blockno is 0.
+// Must be locked.
+void
+bwritev(struct buf **b, uint *blockno, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&b[i]->lock))
+      panic("bwritev");
+  virtio_disk_rwv(b, blockno, n, 1);
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
-
-
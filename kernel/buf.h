@@ -5,8 +5,11 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  uchar data[BSIZE];
+  struct buf *next; // hash bucket chain
+  struct buf *qnext; // replacement queue
+  struct buf *qprev;
+  char inam;   // in the main queue, not the first-time one
+  char ref;    // used since the CLOCK hand last passed
+  uchar data[BSIZE] __attribute__((aligned(8))); // bitmaps are scanned by the word
 };
 
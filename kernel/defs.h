@@ -5,18 +5,24 @@ struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct seg;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vmacct;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, uint*, int);
+struct buf*     bgetblank(uint, uint);
+int             breadahead(uint, uint, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(void);
 
 // console.c
 void            consoleinit(void);
@@ -25,8 +31,10 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+uint64          segfault(struct proc*, uint64, int);
 
 // file.c
+int             fileallocate(struct file*, uint64);
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
@@ -54,22 +62,31 @@ int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+int             ireserve(struct inode*, uint);
+int             iallocblocks(struct inode*, uint, uint);
 
 // ramdisk.c
 void            ramdiskinit(void);
 void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
+// ksm.c
+void            ksminit(void);
+
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kdup(void *);
+int             krefcnt(void *);
+int             kfreecount(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            log_sync(void);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -90,6 +107,9 @@ int             growproc(int);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
+void            proc_reappagetable(pagetable_t, uint64);
+int             reapnow(void);
+void            reapinit(void);
 int             kill(int);
 int             killed(struct proc*);
 void            setkilled(struct proc*);
@@ -101,6 +121,7 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+int             kthread(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
 int             waitx(uint64, uint*, uint*); // ADDED
@@ -113,6 +134,10 @@ void            update_time(void);
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// uaccess.S
+int             uaccess_copy(void*, void*, uint64);
+int             uaccess_copystr(char*, char*, uint64);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -121,6 +146,33 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// shm.c
+void            shminit(void);
+int             shmget(int, uint64);
+uint64          shmat(int);
+int             shmdt(uint64);
+int             shmrm(int);
+
+// swap.c
+void            swapinit(uint);
+int             swapout(void);
+uint64          swapin(pagetable_t, pte_t*);
+void            swapdup(int);
+void            swapfree(int);
+
+// zram.c
+void            zraminit(void);
+int             zstore(int, uint64);
+int             zload(int, uint64);
+void            zfree(int);
+
+// text.c
+void            textinit(void);
+uint64          textget(struct inode*, uint, uint);
+void            textput(struct inode*, uint, uint, uint64);
+int             textmap(pagetable_t, struct inode*, struct seg*);
+void            textinval(struct inode*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -161,6 +213,15 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+struct vmacct*  vmacct(pagetable_t);
+void            asidalloc(struct proc*);
+uint64          uvmsatp(struct proc*);
+void            uvmswitch(struct proc*);
+void            uvmstale(pagetable_t);
+void*           uvmkalloc(void);
+int             uvmoverlimit(struct proc*, uint64);
+int             kvmshare(pagetable_t);
+void            kvmunshare(pagetable_t);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
@@ -168,6 +229,10 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmshare(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+uint64          vmfault(pagetable_t, uint64, int);
+void            uvmprefault(pagetable_t, uint64, uint64, int);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -183,10 +248,24 @@ void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// vma.c
+uint64          vmabase(struct proc*);
+struct vma*     vmaalloc(struct proc*, uint64, int, int, struct file*, uint64);
+uint64          mmap(struct file*, uint64, int, int, uint64);
+int             munmap(uint64, uint64);
+uint64          vmafault(struct proc*, uint64, int);
+void            vmaclose(struct proc*);
+int             vmacopy(struct proc*, struct proc*);
+void            vmadrop(struct proc*);
+
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_rwv(struct buf **, uint *, int, int);
 void            virtio_disk_intr(void);
+int             virtio_disk_read_async(struct buf **, int);
+void            virtio_disk_wait(struct buf *);
+uint64          virtio_disk_capacity(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
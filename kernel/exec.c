@@ -3,12 +3,13 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -26,8 +27,10 @@ exec(char *path, char **argv)
   int i, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct seg seg[NSEG];
+  int nseg = 0;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -49,7 +52,11 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record where each segment lives in the file; the
+  // pages are read in by segfault() on first touch.
+  // Read-only pages may be shared with other processes
+  // through the text cache.
+  memset(seg, 0, sizeof(seg));
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -61,15 +68,27 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr < sz || ph.vaddr + ph.memsz >= HEAPTOP)
+      goto bad;
+    if(ph.memsz == 0)
+      continue;
+    if(nseg >= NSEG)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].memsz = ph.memsz;
+    seg[nseg].filesz = ph.filesz;
+    seg[nseg].off = ph.off;
+    seg[nseg].perm = flags2perm(ph.flags);
+    // another process may already have read in the text.
+    if((seg[nseg].perm & PTE_W) == 0 && textmap(pagetable, ip, &seg[nseg]) < 0)
       goto bad;
+    nseg++;
+    sz = ph.vaddr + ph.memsz;
   }
-  iunlockput(ip);
+  // keep the reference to ip for the segments.
+  iunlock(ip);
   end_op();
+  exe = ip;
   ip = 0;
 
   p = myproc();
@@ -121,12 +140,29 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vmaclose(p);
   oldpagetable = p->pagetable;
+  oldexe = p->exe;
   p->pagetable = pagetable;
   p->sz = sz;
+  p->guard = stackbase - PGSIZE;
+  memset(p->ucache, 0, sizeof(p->ucache));
+  p->exe = exe;
+  memmove(p->seg, seg, sizeof(seg));
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
-  proc_freepagetable(oldpagetable, oldsz);
+#ifdef KERNMAP
+  // stop running on the old page table before freeing it.
+  push_off();
+  uvmswitch(p);
+  pop_off();
+#endif
+  proc_reappagetable(oldpagetable, oldsz);
+  if(oldexe){
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -137,30 +173,76 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    begin_op();
+    iput(exe);
+    end_op();
+  }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+// Read the page of the program segment that contains va
+// in from the executable, after a page fault on an address
+// below p->sz. Pages past the end of the file part of the
+// segment (.bss) are zero.
+// Returns the physical address of the new page, 0 if va is
+// in a segment but the access isn't allowed or memory ran
+// out, or -1 if va is not in any segment.
+uint64
+segfault(struct proc *p, uint64 va, int write)
 {
-  uint i, n;
+  struct seg *s;
+  char *mem;
   uint64 pa;
+  uint n, pgoff;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
+  va = PGROUNDDOWN(va);
+  for(s = p->seg; s < &p->seg[NSEG]; s++)
+    if(s->memsz > 0 && va >= s->va && va < s->va + s->memsz)
+      break;
+  if(s == &p->seg[NSEG])
+    return -1;
+  if(write && (s->perm & PTE_W) == 0)
+    return 0;
+
+  pgoff = va - s->va;
+  n = 0;
+  if(pgoff < s->filesz){
+    if(s->filesz - pgoff < PGSIZE)
+      n = s->filesz - pgoff;
     else
       n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
   }
-  
-  return 0;
+
+  // text may be shared with other processes running the program.
+  if(n > 0 && (s->perm & PTE_W) == 0 && (pa = textget(p->exe, s->off + pgoff, n)) != 0){
+    if(mappages(p->pagetable, va, PGSIZE, pa, PTE_R|PTE_U|s->perm) != 0){
+      kfree((void*)pa);
+      return 0;
+    }
+    return pa;
+  }
+
+  if((mem = uvmkalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  if(n > 0){
+    // fileread() and filewrite() fault in user buffers
+    // before they lock an inode (see uvmprefault()), so no
+    // inode or buffer lock is held here.
+    ilock(p->exe);
+    if(readi(p->exe, 0, (uint64)mem, s->off + pgoff, n) != n){
+      iunlock(p->exe);
+      kfree(mem);
+      return 0;
+    }
+    if((s->perm & PTE_W) == 0)
+      textput(p->exe, s->off + pgoff, n, (uint64)mem);
+    iunlock(p->exe);
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_U|s->perm) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
 }
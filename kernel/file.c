@@ -118,6 +118,7 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
+    uvmprefault(myproc()->pagetable, addr, n, 1);
     ilock(f->ip);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
@@ -148,17 +149,18 @@ filewrite(struct file *f, uint64 addr, int n)
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
+    // i-node, indirect blocks, allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = ((MAXOPBLOCKS-1-4-2) / 2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
+      uvmprefault(myproc()->pagetable, addr + i, n1, 0);
       begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
@@ -180,3 +182,47 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Allocate the disk blocks for the first n bytes of file f
+// ahead of time, in one run if there is a free run that
+// long, without changing its size. Writing them later then
+// allocates nothing, and files written at the same time
+// don't end up interleaved on disk.
+// Fails if the disk doesn't have room for them, or if the
+// file is truncated meanwhile.
+int
+fileallocate(struct file *f, uint64 n)
+{
+  struct inode *ip = f->ip;
+  int max = (MAXOPBLOCKS-1-4-2) / 2;
+  uint bn, nb, k;
+  int r = 0;
+
+  // no further than writei() can write: a uint offset.
+  if(f->type != FD_INODE || f->writable == 0 || n > 0xffffffffUL)
+    return -1;
+  nb = (n + BSIZE - 1) / BSIZE;
+
+  ilock(ip);
+  // fail up front, rather than fill the disk with blocks
+  // past the end of the file.
+  if(ip->type != T_FILE || ireserve(ip, nb) < 0){
+    iunlock(ip);
+    return -1;
+  }
+  iunlock(ip);
+
+  // a few blocks per transaction, like filewrite(). the
+  // file may be truncated between them.
+  for(bn = 0; bn < nb && r == 0; bn += k){
+    k = nb - bn;
+    if(k > max)
+      k = max;
+    begin_op();
+    ilock(ip);
+    r = iallocblocks(ip, bn, k);
+    iunlock(ip);
+    end_op();
+  }
+  return r;
+}
+
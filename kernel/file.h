@@ -20,13 +20,26 @@ struct inode {
   int ref;            // Reference count
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  int text;           // may have pages in the text cache?
 
-  short type;         // copy of disk inode
+  short type;         // copy of disk inode, without DI_EXTENTS
+  int extents;        // addrs[] hold extents
   short major;
   short minor;
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  uint extbn;         // last extent looked up: first block...
+  uint extstart;      // ...its address...
+  uint extlen;        // ...and length, 0 if none
+  uint goal;          // block to allocate next, if free
+  uint rsvstart;      // blocks reserved for the file to grow
+  uint rsvend;        // into, protected by itable.lock
+
+  uint ranext;        // block a sequential read would read next
+  uint raend;         // first block not yet read ahead
+  uint rawin;         // read-ahead window, 0 if reads look random
 };
 
 // map major device number to device functions.
@@ -37,6 +37,8 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bsuminit(int);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,6 +46,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bsuminit(dev);
+  swapinit(sb.size);
 }
 
 // Zero a block.
@@ -52,7 +56,7 @@ bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bgetblank(dev, bno);
   memset(bp->data, 0, BSIZE);
   log_write(bp);
   brelse(bp);
@@ -60,33 +64,182 @@ bzero(int dev, int bno)
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-// returns 0 if out of disk space.
+// A summary of the free bitmap: how many free blocks each
+// bitmap block describes. fsinit() counts them, and balloc()
+// and bfree() keep the counts up to date while they hold the
+// bitmap block, so balloc() can skip full bitmap blocks
+// without reading them.
+#define NBMAP 256
+
+struct {
+  int n;                // bitmap blocks
+  uint nfree[NBMAP];
+  uint rotor;           // block after the last one allocated
+} bsum;
+
+static int
+ctz64(uint64 x)
+{
+  int n = 0;
+
+  if((x & 0xffffffff) == 0){ n += 32; x >>= 32; }
+  if((x & 0xffff) == 0){ n += 16; x >>= 16; }
+  if((x & 0xff) == 0){ n += 8; x >>= 8; }
+  if((x & 0xf) == 0){ n += 4; x >>= 4; }
+  if((x & 0x3) == 0){ n += 2; x >>= 2; }
+  if((x & 0x1) == 0)
+    n += 1;
+  return n;
+}
+
+static int
+popcount64(uint64 x)
+{
+  x = x - ((x >> 1) & 0x5555555555555555UL);
+  x = (x & 0x3333333333333333UL) + ((x >> 2) & 0x3333333333333333UL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fUL;
+  return (x * 0x0101010101010101UL) >> 56;
+}
+
+// Return the first free block that bitmap block bp, which
+// describes the blocks from base on, has at or after block
+// from, a word at a time. Returns 0 if there isn't one.
 static uint
-balloc(uint dev)
+bscan(struct buf *bp, uint base, uint from)
+{
+  uint64 *w = (uint64*)bp->data, x;
+  uint i, b;
+
+  for(i = (from - base) / 64; i < BPB / 64; i++){
+    x = ~w[i];
+    if(i == (from - base) / 64)
+      x &= ~0UL << ((from - base) % 64);
+    if(x){
+      b = base + i*64 + ctz64(x);
+      return b < sb.size ? b : 0;
+    }
+  }
+  return 0;
+}
+
+static void
+bsuminit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint64 *w, x;
+  uint b;
+  int i, j;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
+  bsum.n = (sb.size + BPB - 1) / BPB;
+  if(bsum.n > NBMAP)
+    panic("bsuminit: disk too big");
+  for(i = 0; i < bsum.n; i++){
+    bp = bread(dev, sb.bmapstart + i);
+    w = (uint64*)bp->data;
+    bsum.nfree[i] = 0;
+    for(j = 0; j < BPB / 64; j++){
+      b = i*BPB + j*64;
+      if(b >= sb.size)
+        break;
+      x = ~w[j];
+      if(sb.size - b < 64)
+        x &= (1UL << (sb.size - b)) - 1;
+      bsum.nfree[i] += popcount64(x);
+    }
+    brelse(bp);
+  }
+}
+
+static uint rsvskip(struct inode*, uint);
+static uint enblocks(struct inode*);
+
+// Allocate a zeroed disk block: goal, if it is free, or
+// else the next free one after it, so that a file that asks
+// for the block after its last one gets its blocks in a
+// row. With no goal, starts where the last search ended.
+// Passes over blocks that files other than ip have reserved
+// (see dalloc()), unless there are no others.
+// returns 0 if out of disk space.
+static uint
+balloc(uint dev, uint goal, struct inode *ip)
+{
+  uint b, i, k, r, base, from;
+  struct buf *bp;
+  int pass;
+
+  if(goal == 0 || goal >= sb.size)
+    goal = bsum.rotor;
+  for(pass = 0; pass < 2; pass++){
+    i = goal / BPB;
+    // visits goal's bitmap block twice: from goal on, and at
+    // the end, for the blocks before it.
+    for(k = 0; k <= bsum.n; k++, i = (i + 1) % bsum.n){
+      if(bsum.nfree[i] == 0)
+        continue;
+      base = i * BPB;
+      bp = bread(dev, sb.bmapstart + i);
+      from = (k == 0) ? goal : base;
+      while((b = bscan(bp, base, from)) != 0 && pass == 0 &&
+            (r = rsvskip(ip, b)) != 0)
+        from = r;
+      if(b != 0){
+        bp->data[(b - base)/8] |= 1 << ((b - base) % 8);  // Mark block in use.
+        bsum.nfree[i]--;
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        bzero(dev, b);
+        bsum.rotor = b + 1;
+        return b;
       }
+      brelse(bp);
     }
-    brelse(bp);
   }
   printf("balloc: out of blocks\n");
   return 0;
 }
 
+// Find a run of n free blocks, or else the longest run there
+// is. Returns its first block, and sets *len to its length,
+// at most n.
+static uint
+bfindrun(uint dev, uint n, uint *len)
+{
+  struct buf *bp;
+  uint64 *w;
+  uint b, i, j, start = 0, run = 0, best = 0, bestrun = 0;
+
+  for(i = 0; i < bsum.n && bestrun < n; i++){
+    if(bsum.nfree[i] == 0){
+      run = 0;
+      continue;
+    }
+    bp = bread(dev, sb.bmapstart + i);
+    w = (uint64*)bp->data;
+    for(b = i*BPB; b < (i+1)*BPB && b < sb.size && bestrun < n; b++){
+      j = b - i*BPB;
+      if(j % 64 == 0 && w[j/64] == ~0UL){
+        // a word of blocks in use.
+        run = 0;
+        b += 63;
+        continue;
+      }
+      if((w[j/64] >> (j % 64)) & 1){
+        run = 0;
+        continue;
+      }
+      if(run++ == 0)
+        start = b;
+      if(run > bestrun){
+        best = start;
+        bestrun = run;
+      }
+    }
+    brelse(bp);
+  }
+  *len = bestrun;
+  return best;
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
@@ -100,6 +253,7 @@ bfree(int dev, uint b)
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
+  bsum.nfree[b / BPB]++;
   log_write(bp);
   brelse(bp);
 }
@@ -208,6 +362,8 @@ ialloc(uint dev, short type)
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
+      if(type != T_DEVICE)
+        dip->type |= DI_EXTENTS;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
       return iget(dev, inum);
@@ -230,7 +386,7 @@ iupdate(struct inode *ip)
 
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
-  dip->type = ip->type;
+  dip->type = ip->type | (ip->extents ? DI_EXTENTS : 0);
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
@@ -271,6 +427,7 @@ iget(uint dev, uint inum)
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->text = 1;     // pages may have outlived the last reference
   release(&itable.lock);
 
   return ip;
@@ -303,13 +460,17 @@ ilock(struct inode *ip)
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
-    ip->type = dip->type;
+    ip->type = dip->type & ~DI_EXTENTS;
+    ip->extents = (dip->type & DI_EXTENTS) != 0;
     ip->major = dip->major;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
+    ip->extlen = 0;
+    ip->goal = 0;
+    ip->ranext = ip->raend = ip->rawin = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -357,7 +518,8 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0)
+    ip->rsvstart = ip->rsvend = 0;
   release(&itable.lock);
 }
 
@@ -375,6 +537,214 @@ iunlockput(struct inode *ip)
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
+//
+// Files created since extents were added (see DI_EXTENTS in
+// fs.h) are mapped by emap() instead, and can be as big as
+// a uint offset reaches; the indirect block only maps files
+// on older file system images, of at most MAXFILE blocks.
+// A file's blocks are only ever added at its end, so emap()
+// makes the last extent one longer whenever the block after
+// it is free, and a file written in one go usually needs
+// just a few extents. It remembers the last extent it found.
+
+// A file that is being written reserves the blocks after
+// its last one, so that other files written at the same time
+// allocate theirs elsewhere, rather than in between, and its
+// blocks stay in a row. The log records where each block
+// goes as it is written, so blocks can't wait to be given
+// addresses until they are written back; the reservation
+// keeps the room next to the file free for it instead.
+// A reservation is only a hint: balloc() uses reserved
+// blocks once there are no others, and it ends when the
+// inode leaves the inode table. fileallocate() reserves
+// the whole run a file will need up front.
+
+// If block b is reserved by a file in the inode table
+// other than ip, return the block after the reservation,
+// or else 0.
+static uint
+rsvskip(struct inode *ip, uint b)
+{
+  struct inode *x;
+  uint r = 0;
+
+  acquire(&itable.lock);
+  for(x = &itable.inode[0]; x < &itable.inode[NINODE]; x++){
+    if(x != ip && x->ref > 0 && b >= x->rsvstart && b < x->rsvend){
+      r = x->rsvend;
+      break;
+    }
+  }
+  release(&itable.lock);
+  return r;
+}
+
+// Allocate a data block for ip, at ip->goal if possible,
+// and, if it is outside ip's reservation, reserve the
+// RSVBLOCKS after it, up to the next reservation.
+// returns 0 if out of disk space.
+static uint
+dalloc(struct inode *ip)
+{
+  struct inode *x;
+  uint b, end;
+
+  if((b = balloc(ip->dev, ip->goal, ip)) == 0)
+    return 0;
+  ip->goal = b + 1;
+  acquire(&itable.lock);
+  if(b < ip->rsvstart || b >= ip->rsvend){
+    end = b + RSVBLOCKS;
+    for(x = &itable.inode[0]; x < &itable.inode[NINODE]; x++)
+      if(x != ip && x->ref > 0 && x->rsvstart > b && x->rsvstart < end)
+        end = x->rsvstart;
+    ip->rsvstart = b + 1;
+    ip->rsvend = end;
+  }
+  release(&itable.lock);
+  return b;
+}
+
+// Reserve a run of free blocks for ip to grow to n blocks,
+// or the longest run there is, if none is that long.
+// Caller must hold ip->lock.
+// returns -1, reserving nothing, if there aren't that many
+// free blocks on the disk.
+int
+ireserve(struct inode *ip, uint n)
+{
+  uint start, len, have, nfree;
+  int i;
+
+  have = ip->extents ? enblocks(ip) : (ip->size + BSIZE - 1) / BSIZE;
+  if(n <= have)
+    return 0;
+  n -= have;
+  for(nfree = 0, i = 0; i < bsum.n; i++)
+    nfree += bsum.nfree[i];
+  if(nfree < n)
+    return -1;
+
+  start = bfindrun(ip->dev, n, &len);
+  if(len == 0)
+    return 0;
+  acquire(&itable.lock);
+  ip->rsvstart = start;
+  ip->rsvend = start + len;
+  release(&itable.lock);
+  ip->goal = start;
+  return 0;
+}
+
+// Return the address of block bn, within extent e, which
+// maps the file from block n on; remember e for next time.
+static uint
+ecache(struct inode *ip, uint n, struct extent *e, uint bn)
+{
+  ip->extbn = n;
+  ip->extstart = e->start;
+  ip->extlen = e->len;
+  return e->start + (bn - n);
+}
+
+// Return the disk block address of block bn of ip, which
+// maps its blocks with extents. If bn is just past the end
+// of the file's blocks, allocates it.
+// returns 0 if out of disk space.
+static uint
+emap(struct inode *ip, uint bn)
+{
+  struct extent *e = (struct extent*)ip->addrs, *last = 0;
+  struct extindex *x = 0;
+  struct buf *xp = 0, *lp = 0;
+  uint n = 0, addr = 0, leaf;
+  int i, j = -1, max = NIEXTENT;
+
+  // the extent looked up last time?
+  if(bn - ip->extbn < ip->extlen)
+    return ip->extstart + (bn - ip->extbn);
+
+  for(i = 0; i < NIEXTENT && e[i].len; i++){
+    if(bn < n + e[i].len)
+      return ecache(ip, n, &e[i], bn);
+    n += e[i].len;
+    last = &e[i];
+  }
+
+  if(i == NIEXTENT && ip->addrs[NDIRECT]){
+    // look in the extent block for bn.
+    xp = bread(ip->dev, ip->addrs[NDIRECT]);
+    x = (struct extindex*)xp->data;
+    for(j = 0; j+1 < NEXTINDEX && x[j+1].addr && x[j+1].bn <= bn; j++)
+      ;
+    lp = bread(ip->dev, x[j].addr);
+    e = (struct extent*)lp->data;
+    max = NEXTENT;
+    n = x[j].bn;
+    for(i = 0; i < NEXTENT && e[i].len; i++){
+      if(bn < n + e[i].len){
+        addr = ecache(ip, n, &e[i], bn);
+        goto out;
+      }
+      n += e[i].len;
+      last = &e[i];
+    }
+  }
+
+  // bn is the block after the file's last one.
+  if(bn != n)
+    panic("emap: hole");
+  if(ip->goal == 0 && last)
+    ip->goal = last->start + last->len;
+  if((addr = dalloc(ip)) == 0)
+    goto out;
+  if(last && addr == last->start + last->len){
+    last->len++;
+  } else if(i < max){
+    last = &e[i];
+    last->start = addr;
+    last->len = 1;
+  } else {
+    // a new extent block, for a new extent, and an index
+    // block to list it in, if there isn't one yet. the extent
+    // block comes first, so that the inode never points at
+    // an index block that lists nothing.
+    if(j + 1 == NEXTINDEX || (leaf = balloc(ip->dev, 0, 0)) == 0)
+      goto fail;
+    if(xp == 0){
+      if((ip->addrs[NDIRECT] = balloc(ip->dev, 0, 0)) == 0){
+        bfree(ip->dev, leaf);
+        goto fail;
+      }
+      xp = bread(ip->dev, ip->addrs[NDIRECT]);
+      x = (struct extindex*)xp->data;
+    }
+    j++;
+    x[j].bn = bn;
+    x[j].addr = leaf;
+    log_write(xp);
+    if(lp)
+      brelse(lp);
+    lp = bread(ip->dev, leaf);
+    last = (struct extent*)lp->data;
+    last->start = addr;
+    last->len = 1;
+  }
+  if(lp)
+    log_write(lp);
+  ecache(ip, bn + 1 - last->len, last, bn);
+  goto out;
+
+fail:
+  bfree(ip->dev, addr);
+  addr = 0;
+out:
+  if(lp)
+    brelse(lp);
+  if(xp)
+    brelse(xp);
+  return addr;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
@@ -385,9 +755,12 @@ bmap(struct inode *ip, uint bn)
   uint addr, *a;
   struct buf *bp;
 
+  if(ip->extents)
+    return emap(ip, bn);
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = dalloc(ip);
       if(addr == 0)
         return 0;
       ip->addrs[bn] = addr;
@@ -399,7 +772,7 @@ bmap(struct inode *ip, uint bn)
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
     if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
+      addr = balloc(ip->dev, 0, 0);
       if(addr == 0)
         return 0;
       ip->addrs[NDIRECT] = addr;
@@ -407,7 +780,7 @@ bmap(struct inode *ip, uint bn)
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
+      addr = dalloc(ip);
       if(addr){
         a[bn] = addr;
         log_write(bp);
@@ -420,14 +793,52 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Free the blocks of the n extents at e.
+static void
+etrunc(struct inode *ip, struct extent *e, int n)
+{
+  int i;
+  uint b;
+
+  for(i = 0; i < n && e[i].len; i++){
+    for(b = e[i].start; b < e[i].start + e[i].len; b++)
+      bfree(ip->dev, b);
+    e[i].len = 0;
+  }
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  textinval(ip);
+  acquire(&itable.lock);
+  ip->rsvstart = ip->rsvend = 0;
+  release(&itable.lock);
+  ip->goal = 0;
+  if(ip->extents){
+    etrunc(ip, (struct extent*)ip->addrs, NIEXTENT);
+    if(ip->addrs[NDIRECT]){
+      struct buf *xp = bread(ip->dev, ip->addrs[NDIRECT]);
+      struct extindex *x = (struct extindex*)xp->data;
+      for(i = 0; i < NEXTINDEX && x[i].addr; i++){
+        struct buf *lp = bread(ip->dev, x[i].addr);
+        etrunc(ip, (struct extent*)lp->data, NEXTENT);
+        brelse(lp);
+        bfree(ip->dev, x[i].addr);
+      }
+      brelse(xp);
+      bfree(ip->dev, ip->addrs[NDIRECT]);
+    }
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    ip->extlen = 0;
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -437,11 +848,11 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+    struct buf *bp = bread(ip->dev, ip->addrs[NDIRECT]);
+    uint *a = (uint*)bp->data;
+    for(i = 0; i < NINDIRECT; i++){
+      if(a[i])
+        bfree(ip->dev, a[i]);
     }
     brelse(bp);
     bfree(ip->dev, ip->addrs[NDIRECT]);
@@ -452,6 +863,59 @@ itrunc(struct inode *ip)
   iupdate(ip);
 }
 
+// Return the number of blocks ip's extents map.
+static uint
+enblocks(struct inode *ip)
+{
+  struct extent *e = (struct extent*)ip->addrs;
+  struct extindex *x;
+  struct buf *xp, *lp;
+  uint n = 0;
+  int i, j;
+
+  for(i = 0; i < NIEXTENT && e[i].len; i++)
+    n += e[i].len;
+  if(i < NIEXTENT || ip->addrs[NDIRECT] == 0)
+    return n;
+  xp = bread(ip->dev, ip->addrs[NDIRECT]);
+  x = (struct extindex*)xp->data;
+  for(j = 0; j+1 < NEXTINDEX && x[j+1].addr; j++)
+    ;
+  lp = bread(ip->dev, x[j].addr);
+  e = (struct extent*)lp->data;
+  n = x[j].bn;
+  for(i = 0; i < NEXTENT && e[i].len; i++)
+    n += e[i].len;
+  brelse(lp);
+  brelse(xp);
+  return n;
+}
+
+// Allocate blocks bn..bn+n-1 of ip, without changing its
+// size. With extents, bn must be at most the number of
+// blocks ip has, and isn't if the file was truncated since
+// the caller last looked. Without, they must be below
+// MAXFILE.
+// Caller must hold ip->lock, in a transaction.
+// returns 0, or -1 if out of disk space or if bn is past
+// the end of ip's blocks.
+int
+iallocblocks(struct inode *ip, uint bn, uint n)
+{
+  int r = 0;
+
+  if(ip->extents ? bn > enblocks(ip) : bn + n > MAXFILE)
+    return -1;
+  for(; n > 0; bn++, n--){
+    if(bmap(ip, bn) == 0){
+      r = -1;
+      break;
+    }
+  }
+  iupdate(ip);
+  return r;
+}
+
 // Copy stat information from inode.
 // Caller must hold ip->lock.
 void
@@ -464,6 +928,56 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Note that readi() is about to read block bn of ip, and if
+// ip is being read sequentially, start reading the blocks
+// after it from disk, so that they are in the cache by the
+// time readi() gets to them.
+// The read-ahead window starts at RAMIN blocks and doubles,
+// up to RAMAX, each time the reader catches up with the
+// first half of it. A read anywhere else closes it.
+// Blocks that are next to each other on disk, as in an
+// extent, are read in one request.
+// Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint bn)
+{
+  uint last, addr, start = 0, n = 0;
+
+  if(bn + 1 == ip->ranext)   // more of the same block
+    return;
+  if(bn != ip->ranext){
+    ip->ranext = bn + 1;
+    ip->raend = bn + 1;
+    ip->rawin = 0;
+    return;
+  }
+  ip->ranext = bn + 1;
+  if(ip->rawin && bn + ip->rawin/2 < ip->raend)
+    return;
+
+  ip->rawin = ip->rawin ? min(2*ip->rawin, RAMAX) : RAMIN;
+  if(ip->raend <= bn)
+    ip->raend = bn + 1;
+  last = (ip->size - 1) / BSIZE;
+  for(; ip->raend <= bn + ip->rawin && ip->raend <= last; ip->raend++){
+    // the blocks are below ip->size, so bmap() won't allocate.
+    if((addr = bmap(ip, ip->raend)) == 0)
+      break;
+    if(n > 0 && addr == start + n){
+      n++;
+      continue;
+    }
+    if(n > 0 && breadahead(ip->dev, start, n) < 0){
+      n = 0;
+      break;
+    }
+    start = addr;
+    n = 1;
+  }
+  if(n > 0)
+    breadahead(ip->dev, start, n);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -483,6 +997,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
       break;
+    readahead(ip, off/BSIZE);
     bp = bread(ip->dev, addr);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
@@ -510,9 +1025,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  if(!ip->extents && off + n > MAXFILE*BSIZE)
     return -1;
 
+  textinval(ip);
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
     if(addr == 0)
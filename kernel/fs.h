@@ -26,7 +26,28 @@ struct superblock {
 
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT)  // without DI_EXTENTS
+
+// Inodes with DI_EXTENTS set in their type map their blocks
+// with extents instead: runs of blocks that are contiguous
+// on disk. The first NIEXTENT are in addrs[], and if there
+// are more, addrs[NDIRECT] is the address of an index block
+// of extent blocks.
+#define DI_EXTENTS 0x4000
+
+struct extent {
+  uint start;           // First block of the run
+  uint len;             // Number of blocks; 0 if unused
+};
+
+struct extindex {
+  uint bn;              // First file block the extent block maps
+  uint addr;            // Extent block; 0 if unused
+};
+
+#define NIEXTENT  (NDIRECT / 2)
+#define NEXTENT   (BSIZE / sizeof(struct extent))
+#define NEXTINDEX (BSIZE / sizeof(struct extindex))
 
 // On-disk inode structure
 struct dinode {
@@ -38,6 +59,9 @@ struct dinode {
   uint addrs[NDIRECT+1];   // Data block addresses
 };
 
+// mkfs and existing file system images depend on this.
+_Static_assert(sizeof(struct dinode) == 64, "dinode must be 64 bytes");
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
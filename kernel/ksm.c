@@ -0,0 +1,250 @@
+//
+// Same-page merging: the ksmd kernel thread looks for user
+// pages with identical contents and makes them share one
+// read-only physical page, copy-on-write.
+//
+// ksmd sweeps over every sleeping process's private user
+// pages (those with a single reference, below p->sz), a few
+// at a time, hashing each one.
+//
+// A page whose contents match a page in the stable table is
+// remapped to that page, and its own memory freed.
+//
+// Otherwise the page is compared with the candidate recorded
+// for the same hash, which is another page seen earlier. If
+// they match and the candidate hasn't changed since, the
+// candidate joins the stable table, and the page is merged
+// into it. If they don't match, the page becomes the
+// candidate for its hash.
+//
+// A page in the stable table is shared copy-on-write by the
+// processes that map it, and by the table, which holds a
+// reference to it. Entries that only the table refers to
+// any more are dropped as the sweep comes across them.
+//
+// Like swapout(), ksmd only changes the page tables of
+// processes that are sleeping, and so can't be in the
+// middle of using a page; they flush their stale TLB entries
+// before they run again.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define KSMPAGES  64   // pages ksmd looks at each tick
+
+struct kpage {
+  uint64 hash;
+  uint64 pa;          // 0 if the entry is free
+};
+
+struct kcand {
+  uint64 hash;
+  struct proc *p;     // 0 if the entry is free
+  int pid;            // p's pid when the page was seen
+  uint64 va;
+  uint64 pa;
+};
+
+struct {
+  struct spinlock lock;           // protects stable
+  struct kpage stable[NKSM];
+  struct kcand cand[NKSM];        // only used by ksmd
+  int hand;                       // Sweep position: process...
+  uint64 handva;                  // ...and address in it
+} ksm;
+
+static void ksmd(void);
+
+void
+ksminit(void)
+{
+  initlock(&ksm.lock, "ksm");
+  if(kthread("ksmd", ksmd) < 0)
+    panic("ksminit");
+}
+
+static uint64
+pagehash(uint64 pa)
+{
+  uint64 *w, h = 14695981039346656037UL;
+
+  for(w = (uint64*)pa; w < (uint64*)(pa + PGSIZE); w++)
+    h = (h ^ *w) * 1099511628211UL;
+  return h;
+}
+
+// Return p's leaf PTE for user page va if ksmd may merge the
+// page, or 0. Caller holds p->lock.
+static pte_t*
+ksmpte(struct proc *p, uint64 va)
+{
+  pte_t *pte;
+
+  if(p->state != SLEEPING || p->pagetable == 0 || va >= p->sz)
+    return 0;
+  if((pte = walk(p->pagetable, va, 0)) == 0)
+    return 0;
+  if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U) || !PTE_LEAF(*pte))
+    return 0;
+  if(krefcnt((void*)PTE2PA(*pte)) != 1)
+    return 0;
+  return pte;
+}
+
+// Point *pte, in sleeping process p's page table, at the
+// stable page kpa, copy-on-write, and free the page it
+// mapped. Caller holds p->lock.
+static void
+ksmmap(struct proc *p, pte_t *pte, uint64 kpa)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte);
+
+  if(flags & PTE_W)
+    flags = (flags & ~PTE_W) | PTE_COW;
+  kdup((void*)kpa);
+  *pte = PA2PTE(kpa) | flags;
+  __sync_fetch_and_or(&p->tlbstale, ~0L);
+  if(pa != kpa)
+    kfree((void*)pa);
+}
+
+// Return the stable page with hash h and the same contents
+// as the page at pa, with a reference for the caller, or 0.
+// Drops the entry if no one else maps it any more.
+static uint64
+stableget(uint64 h, uint64 pa)
+{
+  struct kpage *k = &ksm.stable[h % NKSM];
+  uint64 kpa = 0;
+
+  acquire(&ksm.lock);
+  if(k->pa && krefcnt((void*)k->pa) == 1){
+    kfree((void*)k->pa);
+    k->pa = 0;
+  }
+  if(k->pa && k->hash == h && memcmp((void*)k->pa, (void*)pa, PGSIZE) == 0){
+    kpa = k->pa;
+    kdup((void*)kpa);
+  }
+  release(&ksm.lock);
+  return kpa;
+}
+
+// Make the candidate c a stable page, if it still maps the
+// page it did, and that page's contents haven't changed.
+// Returns 0, or -1.
+static int
+stableput(struct kcand *c)
+{
+  struct kpage *k = &ksm.stable[c->hash % NKSM];
+  struct proc *p = c->p;
+  pte_t *pte;
+  int r = -1;
+
+  acquire(&p->lock);
+  if(p->pid == c->pid && (pte = ksmpte(p, c->va)) != 0 &&
+     PTE2PA(*pte) == c->pa && pagehash(c->pa) == c->hash){
+    acquire(&ksm.lock);
+    if(k->pa && krefcnt((void*)k->pa) == 1){
+      kfree((void*)k->pa);
+      k->pa = 0;
+    }
+    if(k->pa == 0){
+      // the table's reference, and make p's mapping
+      // copy-on-write.
+      k->hash = c->hash;
+      k->pa = c->pa;
+      ksmmap(p, pte, c->pa);
+      r = 0;
+    }
+    release(&ksm.lock);
+  }
+  release(&p->lock);
+  return r;
+}
+
+// Look at the next page in the sweep.
+static void
+ksmstep(void)
+{
+  struct proc *p = &proc[ksm.hand];
+  struct kcand *c;
+  pte_t *pte;
+  uint64 va, pa, kpa, h;
+
+  acquire(&p->lock);
+  if(p->state != SLEEPING || ksm.handva >= p->sz){
+    release(&p->lock);
+    ksm.hand = (ksm.hand + 1) % NPROC;
+    ksm.handva = 0;
+    return;
+  }
+  va = ksm.handva;
+  ksm.handva += PGSIZE;
+  if(walk(p->pagetable, va, 0) == 0){
+    // skip the rest of a hole in the address space.
+    ksm.handva = (va + (1L << PXSHIFT(1))) & ~((1L << PXSHIFT(1)) - 1);
+    release(&p->lock);
+    return;
+  }
+  if((pte = ksmpte(p, va)) == 0){
+    release(&p->lock);
+    return;
+  }
+  pa = PTE2PA(*pte);
+  h = pagehash(pa);
+
+  if((kpa = stableget(h, pa)) != 0){
+    ksmmap(p, pte, kpa);
+    kfree((void*)kpa);
+    release(&p->lock);
+    return;
+  }
+
+  c = &ksm.cand[h % NKSM];
+  if(c->p == 0 || c->hash != h || (c->p == p && c->va == va) ||
+     memcmp((void*)c->pa, (void*)pa, PGSIZE) != 0){
+    // c->pa may have been freed and reused, so it is only a
+    // hint until stableput() checks it.
+    c->hash = h;
+    c->p = p;
+    c->pid = p->pid;
+    c->va = va;
+    c->pa = pa;
+    release(&p->lock);
+    return;
+  }
+  release(&p->lock);
+
+  // a match: stable the candidate, then merge this page with
+  // it, if p hasn't changed the page or run meanwhile.
+  if(stableput(c) < 0)
+    return;
+  c->p = 0;
+  acquire(&p->lock);
+  if((pte = ksmpte(p, va)) != 0 && (kpa = stableget(h, PTE2PA(*pte))) != 0){
+    ksmmap(p, pte, kpa);
+    kfree((void*)kpa);
+  }
+  release(&p->lock);
+}
+
+static void
+ksmd(void)
+{
+  int i;
+
+  for(;;){
+    for(i = 0; i < KSMPAGES; i++)
+      ksmstep();
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    release(&tickslock);
+  }
+}
@@ -21,6 +21,20 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
+// Commits are delayed: the modified blocks wait, pinned in
+// the buffer cache, while later system calls add to the
+// same transaction. The flusher thread commits it once it
+// is LOGDELAY ticks old. end_op() only commits itself if
+// the log is too full for another system call, or if
+// log_sync() asked it to, for fsync().
+//
+// A commit first copies the transaction's blocks into the
+// log's buffers, with no FS system call active. From then
+// on it works from those copies, so new system calls can
+// start, and fill the next transaction, while it writes the
+// log and installs the blocks. Only one transaction is
+// being written at a time.
+//
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
@@ -41,15 +55,26 @@ struct log {
   struct spinlock lock;
   int start;
   int size;
+  int cap;         // max blocks in a transaction: LOGSIZE, or less if the log is small
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // copying lh to the log buffers, please wait.
+  int writing;     // writing clh to disk.
   int dev;
-  struct logheader lh;
+  int force;       // commit at the next end_op(), for log_sync()
+  int seq;         // number of the transaction in lh
+  int done;        // number of the last transaction on disk
+  uint dirtied;    // ticks when the transaction got its first block
+  struct logheader lh;   // the transaction system calls add to
+  struct logheader clh;  // the transaction being written
+  struct buf *lbuf[LOGSIZE]; // clh's log buffers, while writing it
+  struct buf *ibuf[LOGSIZE]; // the same, sorted by home block
+  uint iblock[LOGSIZE];      // clh's home blocks, sorted
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void flusher(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -60,38 +85,63 @@ initlog(int dev, struct superblock *sb)
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
+  log.cap = log.size - 1 < LOGSIZE ? log.size - 1 : LOGSIZE;
+  if (log.cap < MAXOPBLOCKS)
+    panic("initlog: log too small");
   log.dev = dev;
+  log.seq = 1;
   recover_from_log();
+  if(kthread("logflush", flusher) < 0)
+    panic("initlog: flusher");
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location.
+// When recovering, the home blocks go through the buffer
+// cache. Otherwise the cache's copies may already hold
+// newer updates, from the next transaction, so the log
+// buffers in log.lbuf are written straight to the home
+// locations, in one batch, in order of block number, so
+// that neighbouring blocks go in one disk request.
 static void
-install_trans(int recovering)
+install_trans(struct logheader *lh, int recovering)
 {
-  int tail;
+  struct buf **b = log.ibuf;
+  uint *blockno = log.iblock;
+  int i, j, tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  if (recovering) {
+    for (tail = 0; tail < lh->n; tail++) {
+      struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
+      struct buf *dbuf = bread(log.dev, lh->block[tail]); // read dst
+      memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
+      bwrite(dbuf);  // write dst to disk
+      brelse(lbuf);
+      brelse(dbuf);
+    }
+    return;
   }
+
+  for (i = 0; i < lh->n; i++) {
+    for (j = i; j > 0 && blockno[j-1] > lh->block[i]; j--) {
+      blockno[j] = blockno[j-1];
+      b[j] = b[j-1];
+    }
+    blockno[j] = lh->block[i];
+    b[j] = log.lbuf[i];
+  }
+  bwritev(b, blockno, lh->n);
 }
 
 // Read the log header from disk into the in-memory log header
 static void
-read_head(void)
+read_head(struct logheader *lh)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  lh->n = hb->n;
+  for (i = 0; i < lh->n; i++) {
+    lh->block[i] = hb->block[i];
   }
   brelse(buf);
 }
@@ -100,14 +150,14 @@ read_head(void)
 // This is the true point at which the
 // current transaction commits.
 static void
-write_head(void)
+write_head(struct logheader *lh)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = lh->n;
+  for (i = 0; i < lh->n; i++) {
+    hb->block[i] = lh->block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -116,10 +166,10 @@ write_head(void)
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  read_head(&log.clh);
+  install_trans(&log.clh, 1); // if committed, copy from log to disk
+  log.clh.n = 0;
+  write_head(&log.clh); // clear the log
 }
 
 // called at the start of each FS system call.
@@ -130,7 +180,7 @@ begin_op(void)
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > log.cap){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
@@ -141,8 +191,40 @@ begin_op(void)
   }
 }
 
+// Should the transaction in lh be committed now?
+// Caller holds log.lock.
+static int
+commitdue(void)
+{
+  return log.outstanding == 0 && !log.committing && !log.writing &&
+    (log.force || log.lh.n + MAXOPBLOCKS > log.cap);
+}
+
+// Commit lh, and any transaction that becomes due while
+// it is being written, letting begin_op() and log_sync()
+// know. Caller has set log.committing.
+static void
+commit_and_wake(void)
+{
+  int again;
+
+  // call commit w/o holding locks, since not allowed
+  // to sleep with locks.
+  do {
+    commit();
+    acquire(&log.lock);
+    if((again = commitdue()) != 0)
+      log.committing = 1;
+    wakeup(&log);
+    release(&log.lock);
+  } while(again);
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// and another one might not fit in the log, or log_sync()
+// is waiting. if a commit is still writing, it checks
+// again once it is done.
 void
 end_op(void)
 {
@@ -152,7 +234,7 @@ end_op(void)
   log.outstanding -= 1;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
+  if(commitdue()){
     do_commit = 1;
     log.committing = 1;
   } else {
@@ -163,43 +245,137 @@ end_op(void)
   }
   release(&log.lock);
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
+  if(do_commit)
+    commit_and_wake();
+}
+
+// Wait until the updates of every FS system call that has
+// finished are on disk.
+void
+log_sync(void)
+{
+  int seq;
+
+  begin_op();
+  acquire(&log.lock);
+  // this op and everything before it are in transaction seq,
+  // or earlier.
+  seq = log.seq;
+  log.force = 1;
+  release(&log.lock);
+  end_op();
+
+  acquire(&log.lock);
+  while(log.done < seq)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
+
+// The flusher thread: commits the transaction once it is
+// LOGDELAY ticks old and no FS system call is under way.
+static void
+flusher(void)
+{
+  uint now;
+
+  for(;;){
+    acquire(&tickslock);
+    sleep(&ticks, &tickslock);
+    now = ticks;
+    release(&tickslock);
+
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+    if(log.outstanding > 0 || log.committing || log.writing ||
+       ((log.lh.n == 0 || now - log.dirtied < LOGDELAY) && !log.force)){
+      release(&log.lock);
+      continue;
+    }
+    log.committing = 1;
     release(&log.lock);
+    commit_and_wake();
   }
 }
 
-// Copy modified blocks from cache to log.
+// Copy modified blocks from cache to log buffers, which
+// the commit keeps locked in log.lbuf until it has written
+// them to the log and to their home locations.
 static void
-write_log(void)
+copy_log(struct logheader *lh)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
+  for (tail = 0; tail < lh->n; tail++) {
+    struct buf *to = bgetblank(log.dev, log.start+tail+1); // log block
+    struct buf *from = bread(log.dev, lh->block[tail]); // cache block
     memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
     brelse(from);
-    brelse(to);
+    log.lbuf[tail] = to;
+  }
+}
+
+// Write the log buffers to the log, which is contiguous,
+// so one disk request will do for many blocks.
+static void
+write_log(struct logheader *lh)
+{
+  bwritev(log.lbuf, 0, lh->n);
+}
+
+// Release the log buffers.
+static void
+release_log(struct logheader *lh)
+{
+  int tail;
+
+  for (tail = 0; tail < lh->n; tail++)
+    brelse(log.lbuf[tail]);
+}
+
+// Let the cache recycle the committed blocks.
+static void
+unpin_trans(struct logheader *lh)
+{
+  int tail;
+
+  for (tail = 0; tail < lh->n; tail++) {
+    struct buf *b = bread(log.dev, lh->block[tail]);
+    bunpin(b);
+    brelse(b);
   }
 }
 
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  int seq;
+
+  // no FS system calls are active: take a copy of the
+  // transaction, and let them start again.
+  copy_log(&log.lh);
+  acquire(&log.lock);
+  log.clh = log.lh;
+  log.lh.n = 0;
+  log.force = 0;
+  seq = log.seq++;
+  log.committing = 0;
+  log.writing = 1;
+  wakeup(&log);
+  release(&log.lock);
+
+  if (log.clh.n > 0) {
+    write_log(&log.clh);     // Write the copies to the log
+    write_head(&log.clh);    // Write header to disk -- the real commit
+    install_trans(&log.clh, 0); // Now install writes to home locations
+    release_log(&log.clh);
+    unpin_trans(&log.clh);
+    log.clh.n = 0;
+    write_head(&log.clh);    // Erase the transaction from the log
   }
+
+  acquire(&log.lock);
+  log.writing = 0;
+  log.done = seq;
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -217,7 +393,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.cap)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -227,10 +403,11 @@ log_write(struct buf *b)
       break;
   }
   log.lh.block[i] = b->blockno;
+  if (log.lh.n == 0)
+    log.dirtied = ticks;
   if (i == log.lh.n) {  // Add new block to log?
     bpin(b);
     log.lh.n++;
   }
   release(&log.lock);
 }
-
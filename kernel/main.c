@@ -27,8 +27,13 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    shminit();       // shared memory segments
+    textinit();      // shared program text cache
+    zraminit();      // compressed swap in memory
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    ksminit();       // same-page merging thread
+    reapinit();      // dead address space freeing thread
     __sync_synchronize();
     started = 1;
   } else {
@@ -62,6 +62,23 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap() regions, growing down from MMAPTOP
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+#ifdef KERNMAP
+// the kernel's devices and RAM, from PLIC to PHYSTOP, and its
+// stacks are also mapped (without PTE_U) into every user page
+// table. the heap must stay below the devices, and mmap()
+// regions between the gigabyte that holds the kernel's RAM,
+// whose page-table page every process shares, and the
+// kernel stacks.
+#define HEAPTOP PLIC
+#define MMAPBASE (KERNBASE + 0x40000000L)
+#define MMAPTOP KSTACK(NPROC)
+#else
+#define HEAPTOP TRAPFRAME
+#define MMAPBASE 0
+#define MMAPTOP TRAPFRAME
+#endif
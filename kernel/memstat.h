@@ -0,0 +1,8 @@
+// Memory held by a process, in pages, from memstat().
+struct memstat {
+  int rss;      // User pages mapped
+  int swap;     // User pages in swap
+  int ptpages;  // Page-table pages
+  int kpages;   // Kernel stack and trapframe pages
+  int limit;    // Most user pages it may map, 0 if no limit
+};
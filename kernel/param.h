@@ -6,8 +6,23 @@
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define MAXOPBLOCKS  16  // max # of blocks any FS op writes
+#define LOGSIZE      (MAXOPBLOCKS*12) // max data blocks in on-disk log
+#define LOGDELAY     30    // ticks before a finished FS op is committed
+#define NBUF         (LOGSIZE*3+MAXOPBLOCKS*3) // minimum size of disk block cache
+#define BUFDIV       32    // disk block cache gets 1/BUFDIV of memory
+#define RAMIN        4     // first read-ahead window, in blocks
+#define RAMAX        64    // largest read-ahead window, in blocks
+#define RSVBLOCKS    32    // blocks a growing file reserves after its end
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NSEG         4     // loadable program segments per process
+#define NTEXT        256   // pages in the shared program text cache
+#define NUCACHE      8     // cached user page translations per process
+#define NSWAP        16384 // swap slots, on disk or compressed in memory
+#define NZSLAB       2048  // pages of compressed swap in memory
+#define NKSM         512   // entries in the same-page merging tables
+#define REAPBATCH    256   // pages the reaper frees between yields
+#define NVMA         16    // mapped regions per process
+#define NSHM         16    // maximum number of shared memory segments
+#define SHMMAXPG     256   // maximum pages in a shared memory segment
@@ -16,6 +16,8 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
+static void reaper(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -23,6 +25,19 @@ extern char trampoline[]; // trampoline.S
 int noPinQ[5] = {0};
 struct proc *qproc[5][NPROC];
 
+// Page tables of dead processes, waiting for reaper() to
+// free them.
+struct
+{
+  struct spinlock lock;
+  int n;
+  struct
+  {
+    pagetable_t pagetable;
+    uint64 sz;
+  } q[NPROC];
+} reap;
+
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
 // memory model when using p->parent.
@@ -148,6 +163,7 @@ static struct proc *
 allocproc(void)
 {
   struct proc *p;
+  pagetable_t pagetable;
  for (p = proc; p < &proc[NPROC]; p++) {
     acquire(&p->lock);
     if (p->state == UNUSED)
@@ -170,29 +186,29 @@ found:
     aloc_MLFQ(p);              //
     /////////////////////////////
 
+  // USED keeps the slot ours, so build the rest without
+  // p->lock: making room in memory for the page table may
+  // sleep.
+  release(&p->lock);
+
   // Allocate a trapframe page.
-  if (!(p->trapframe = (struct trapframe *)kalloc()))
-  {
-    freeproc(p);
-    release(&p->lock);
-    return 0;
-  }
+  p->trapframe = (struct trapframe *)kalloc();
 ///// ALLOCATING MEMORY TO COPY OF TRAPFRAME /////////////
-  if (!(p->copy_tf = (struct trapframe *)kalloc()))     //
-  {                                                     //
-    freeproc(p);                                        //
-    release(&p->lock);                                  //
-    return 0;                                           //
-  }                                                     //
+  p->copy_tf = (struct trapframe *)kalloc();            //
 //////////////////////////////////////////////////////////
   // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if (p->pagetable == 0)
+  pagetable = 0;
+  if (p->trapframe && p->copy_tf)
+    pagetable = proc_pagetable(p);
+
+  acquire(&p->lock);
+  if (pagetable == 0)
   {
     freeproc(p);
     release(&p->lock);
     return 0;
   }
+  p->pagetable = pagetable;
 
   // Set up new context to start executing at forkret,
   // which returns to user space.
@@ -220,11 +236,14 @@ freeproc(struct proc *p)
   //////////////////////////////////
 
   if (p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
+    proc_reappagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
+  p->guard = 0;
+  p->memlimit = 0;
   p->pid = 0;
   p->parent = 0;
+  p->kfn = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
@@ -246,6 +265,10 @@ proc_pagetable(struct proc *p)
   if (pagetable == 0)
     return 0;
 
+  // The TLB tags its entries with p's address-space identifier.
+  asidalloc(p);
+  memset(p->ucache, 0, sizeof(p->ucache));
+
   // map the trampoline code (for system call return)
   // at the highest user virtual address.
   // only the supervisor uses it, on the way
@@ -267,6 +290,19 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
+#ifdef KERNMAP
+  // map the kernel too, so that traps need not switch
+  // page tables.
+  if (kvmshare(pagetable) < 0)
+  {
+    kvmunshare(pagetable);
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+#endif
+
   return pagetable;
 }
 
@@ -274,11 +310,99 @@ proc_pagetable(struct proc *p)
 // physical memory it refers to.
 void proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
+#ifdef KERNMAP
+  kvmunshare(pagetable);
+#endif
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
   uvmfree(pagetable, sz);
 }
 
+// Hand a page table that no hart is using any more to the
+// reaper thread to free, along with the memory it refers to,
+// so that a dead process's parent doesn't wait for it in
+// wait(). Frees it right away if the reaper is too far behind.
+void proc_reappagetable(pagetable_t pagetable, uint64 sz)
+{
+  acquire(&reap.lock);
+  if (reap.n < NELEM(reap.q))
+  {
+    reap.q[reap.n].pagetable = pagetable;
+    reap.q[reap.n].sz = sz;
+    reap.n++;
+    pagetable = 0;
+  }
+  release(&reap.lock);
+  if (pagetable)
+    proc_freepagetable(pagetable, sz);
+}
+
+// Free one page table waiting for the reaper, without
+// sleeping, when memory is short. Returns 0, or -1 if there
+// was none.
+int reapnow(void)
+{
+  pagetable_t pagetable;
+  uint64 sz;
+
+  acquire(&reap.lock);
+  if (reap.n == 0)
+  {
+    release(&reap.lock);
+    return -1;
+  }
+  reap.n--;
+  pagetable = reap.q[reap.n].pagetable;
+  sz = reap.q[reap.n].sz;
+  release(&reap.lock);
+
+  proc_freepagetable(pagetable, sz);
+  return 0;
+}
+
+// The reaper thread: checks for dead page tables every tick,
+// and frees each one's user pages REAPBATCH at a time,
+// letting other processes run in between.
+static void reaper(void)
+{
+  pagetable_t pagetable;
+  uint64 sz, va, n;
+
+  for (;;)
+  {
+    acquire(&reap.lock);
+    if (reap.n == 0)
+    {
+      release(&reap.lock);
+      acquire(&tickslock);
+      sleep(&ticks, &tickslock);
+      release(&tickslock);
+      continue;
+    }
+    reap.n--;
+    pagetable = reap.q[reap.n].pagetable;
+    sz = reap.q[reap.n].sz;
+    release(&reap.lock);
+
+    for (va = 0; va < PGROUNDUP(sz); va += n * PGSIZE)
+    {
+      n = (PGROUNDUP(sz) - va) / PGSIZE;
+      if (n > REAPBATCH)
+        n = REAPBATCH;
+      uvmunmap(pagetable, va, n, 1);
+      yield();
+    }
+    proc_freepagetable(pagetable, 0);
+  }
+}
+
+void reapinit(void)
+{
+  initlock(&reap.lock, "reap");
+  if (kthread("reaper", reaper) < 0)
+    panic("reapinit");
+}
+
 // a user program that calls exec("/init")
 // assembled from ../user/initcode.S
 // od -t xC ../user/initcode
@@ -318,7 +442,29 @@ void userinit(void)
   release(&p->lock);
 }
 
+// Start a kernel thread: a process that runs fn in the
+// kernel and never enters user space, for work done in the
+// background. fn must not return.
+// Returns the new thread's pid, or -1.
+int kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+  int pid;
+
+  if ((p = allocproc()) == 0)
+    return -1;
+  p->context.ra = (uint64)kthreadret;
+  p->kfn = fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+  pid = p->pid;
+  p->state = RUNNABLE;
+  release(&p->lock);
+  return pid;
+}
+
 // Grow or shrink user memory by n bytes.
+// Growing only reserves address space; vmfault()
+// allocates and zeroes each page on first touch.
 // Return 0 on success, -1 on failure.
 int growproc(int n)
 {
@@ -328,10 +474,17 @@ int growproc(int n)
   sz = p->sz;
   if (n > 0)
   {
-    if ((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0)
+    if (sz + n > vmabase(p) || sz + n > HEAPTOP)
+    {
+      return -1;
+    }
+    // fail now, rather than at a page fault, if the new
+    // pages wouldn't fit in the memory limit.
+    if (uvmoverlimit(p, (PGROUNDUP(sz + n) - PGROUNDUP(sz)) / PGSIZE))
     {
       return -1;
     }
+    sz += n;
   }
   else if (n < 0)
   {
@@ -355,14 +508,34 @@ int fork(void)
     return -1;
   }
 
+  // Copy the memory without np->lock, like allocproc(), so
+  // that uvmkalloc() can page out memory to make room. np is
+  // USED, so no one else looks at its memory meanwhile.
+  release(&np->lock);
+
   // Copy user memory from parent to child.
   if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0)
   {
+    acquire(&np->lock);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  np->guard = p->guard;
+
+  // Share memory-mapped regions with the child.
+  if (vmacopy(p, np) < 0)
+  {
+    vmadrop(np);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+
+  acquire(&np->lock);
+  np->memlimit = p->memlimit;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -379,6 +552,9 @@ int fork(void)
     if (p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if (p->exe)
+    np->exe = idup(p->exe);
+  memmove(np->seg, p->seg, sizeof(p->seg));
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -426,6 +602,9 @@ void exit(int status)
   if (p == initproc)
     panic("init exiting");
 
+  // Unmap memory-mapped files, writing back shared ones.
+  vmaclose(p);
+
   // Close all open files.
   for (int fd = 0; fd < NOFILE; fd++)
   {
@@ -439,8 +618,11 @@ void exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if (p->exe)
+    iput(p->exe);
   end_op();
   p->cwd = 0;
+  p->exe = 0;
 
   acquire(&wait_lock);
 
@@ -471,9 +653,16 @@ p->TIME_EXIT = ticks; // SETTING EXIT TIME WHEN PROCESS EXITS
 int wait(uint64 addr)
 {
   struct proc *pp;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
 
+  // check addr before reaping a child, so that a bad pointer
+  // fails without losing the child's exit status.
+  xstate = 0;
+  if (addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                           sizeof(xstate)) < 0)
+    return -1;
+
   acquire(&wait_lock);
 
   for (;;)
@@ -491,17 +680,17 @@ int wait(uint64 addr)
         if (pp->state == ZOMBIE)
         {
           // Found one.
+          // copy the status out once the locks are released,
+          // since the copy may fault and sleep; addr was
+          // checked above, so this can only swap the page in.
           pid = pp->pid;
-          if (addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                   sizeof(pp->xstate)) < 0)
-          {
-            release(&pp->lock);
-            release(&wait_lock);
-            return -1;
-          }
+          xstate = pp->xstate;
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
+          if (addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                   sizeof(xstate)) < 0)
+            return -1;
           return pid;
         }
         release(&pp->lock);
@@ -893,7 +1082,14 @@ void sched(void) {
         panic("sched interruptible");
 
     intena = mycpu()->intena;
+#ifdef KERNMAP
+    // p's page table may be freed once p->lock is released.
+    uvmswitch(0);
+#endif
     swtch(&p->context, &mycpu()->context);
+#ifdef KERNMAP
+    uvmswitch(p);
+#endif
     mycpu()->intena = intena;
 }
 
@@ -920,6 +1116,9 @@ void forkret(void)
   static int first = 1;
 
   // Still holding p->lock from scheduler.
+#ifdef KERNMAP
+  uvmswitch(myproc());
+#endif
   release(&myproc()->lock);
 
   if (first)
@@ -934,6 +1133,22 @@ void forkret(void)
   usertrapret();
 }
 
+// A kernel thread's first scheduling by scheduler()
+// will swtch to kthreadret.
+static void kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+#ifdef KERNMAP
+  uvmswitch(p);
+#endif
+  release(&p->lock);
+
+  p->kfn();
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void sleep(void *chan, struct spinlock *lk)
@@ -1125,9 +1340,15 @@ int
 waitx(uint64 addr, uint* wtime, uint* rtime)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
 
+  // check addr before reaping a child, as in wait().
+  xstate = 0;
+  if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                          sizeof(xstate)) < 0)
+    return -1;
+
   acquire(&wait_lock);
 
   for(;;){
@@ -1144,15 +1365,13 @@ waitx(uint64 addr, uint* wtime, uint* rtime)
           pid = np->pid;
           *rtime = np->TOTAL_TIME_RUN;
           *wtime = np->TIME_EXIT - np->TIME_CREATE - np->TOTAL_TIME_RUN;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&wait_lock);
-            return -1;
-          }
+          xstate = np->xstate;
           freeproc(np);
           release(&np->lock);
           release(&wait_lock);
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                  sizeof(xstate)) < 0)
+            return -1;
           return pid;
         }
         release(&np->lock);
@@ -24,6 +24,7 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation this hart's TLB was last flushed for.
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +80,44 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of user memory above the heap, created by mmap().
+// Pages are filled in from the file on first touch.
+// A slot is free if len is 0.
+struct vma {
+  uint64 addr;                 // Start of the region, page-aligned
+  uint64 len;                  // Length in bytes, page-aligned
+  int prot;                    // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // Mapped file, or 0 for shared memory
+  uint64 off;                  // File offset mapped at addr
+};
+
+// A loadable segment of the running program, recorded by
+// exec(). Pages are read from the executable on first touch.
+// A slot is free if memsz is 0.
+struct seg {
+  uint64 va;                   // Start of the segment, page-aligned
+  uint64 memsz;                // Size in memory (bytes)
+  uint64 filesz;               // Bytes backed by the file; the rest is zero
+  uint off;                    // File offset of the segment
+  int perm;                    // PTE_X, PTE_W
+};
+
+// A recent user page translation, for copyin() and copyout().
+struct ucache {
+  uint64 va;                   // Page-aligned user address
+  pte_t *pte;                  // Its leaf PTE, or 0 if the slot is free
+};
+
+// Memory held by a user page table, in pages. vm.c keeps
+// one for each page table, from uvmcreate() to uvmfree().
+struct vmacct {
+  pagetable_t pagetable;       // 0 if the slot is free
+  int rss;                     // User pages mapped
+  int swap;                    // User pages in swap
+  int ptpages;                 // Page-table pages
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -98,12 +137,22 @@ struct proc {
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
+  uint64 guard;                // User stack guard page, or 0
+  int memlimit;                // Most user pages it may map, 0 if no limit
   pagetable_t pagetable;       // User page table
+  int asid;                    // Address-space identifier in satp
+  uint64 asidgen;              // Generation asid was allocated in
+  uint64 tlbstale;             // Harts that must flush asid before running p
+  struct ucache ucache[NUCACHE]; // Where copyin/copyout found recent pages' PTEs
   struct trapframe *trapframe; // data page for trampoline.S
   struct trapframe *copy_tf;   //
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // Memory-mapped regions
+  struct inode *exe;           // Executable backing seg[]
+  struct seg seg[NSEG];        // Program segments, demand-paged
+  void (*kfn)(void);           // Kernel thread's body, or 0
   char name[16];               // Process name (debugging)
   
 /////////////////
@@ -0,0 +1,168 @@
+//
+// Shared memory segments.
+//
+// shmget() finds or creates a segment by key and allocates
+// its pages. shmat() maps every page of a segment into the
+// calling process as a MAP_SHARED region with no file, so
+// processes that attach the same segment see the same
+// physical pages and exchange data without copying.
+//
+// The segment table holds one reference to each page, and
+// every attachment holds another, dropped by uvmunmap()
+// when the region is detached or the process's page table
+// is freed. shmrm() removes the key and drops the table's
+// references; the pages are freed once the last process
+// detaches.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fcntl.h"
+
+struct shmseg {
+  int used;
+  int key;
+  int npages;
+  uint64 pages[SHMMAXPG];
+};
+
+struct {
+  struct spinlock lock;
+  struct shmseg seg[NSHM];
+} shm;
+
+void
+shminit(void)
+{
+  initlock(&shm.lock, "shm");
+}
+
+// Release the pages of a segment that are
+// still held by the table. Caller holds shm.lock.
+static void
+shmfree(struct shmseg *s)
+{
+  for(int i = 0; i < s->npages; i++)
+    kfree((void*)s->pages[i]);
+  s->npages = 0;
+  s->used = 0;
+}
+
+// Return the id of the segment with the given key,
+// creating it with room for sz bytes if it doesn't exist.
+// Returns -1 if sz is too big for an existing segment
+// or for a new one, or if out of memory.
+int
+shmget(int key, uint64 sz)
+{
+  struct shmseg *s, *free;
+  int n = PGROUNDUP(sz) / PGSIZE;
+
+  acquire(&shm.lock);
+  free = 0;
+  for(s = shm.seg; s < &shm.seg[NSHM]; s++){
+    if(s->used && s->key == key){
+      release(&shm.lock);
+      if(n > s->npages)
+        return -1;
+      return s - shm.seg;
+    }
+    if(free == 0 && !s->used)
+      free = s;
+  }
+  if(free == 0 || sz == 0 || n > SHMMAXPG){
+    release(&shm.lock);
+    return -1;
+  }
+
+  s = free;
+  s->used = 1;
+  s->key = key;
+  for(s->npages = 0; s->npages < n; s->npages++){
+    char *mem = kalloc();
+    if(mem == 0){
+      shmfree(s);
+      release(&shm.lock);
+      return -1;
+    }
+    memset(mem, 0, PGSIZE);
+    s->pages[s->npages] = (uint64)mem;
+  }
+  release(&shm.lock);
+  return s - shm.seg;
+}
+
+// Map segment id into the current process.
+// Returns the address it is mapped at, or -1.
+uint64
+shmat(int id)
+{
+  struct proc *p = myproc();
+  struct shmseg *s;
+  struct vma *v;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  s = &shm.seg[id];
+
+  acquire(&shm.lock);
+  if(!s->used){
+    release(&shm.lock);
+    return -1;
+  }
+  v = vmaalloc(p, (uint64)s->npages * PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, 0, 0);
+  if(v == 0){
+    release(&shm.lock);
+    return -1;
+  }
+  for(int i = 0; i < s->npages; i++){
+    if(mappages(p->pagetable, v->addr + (uint64)i*PGSIZE, PGSIZE, s->pages[i],
+                PTE_R|PTE_W|PTE_U) != 0){
+      release(&shm.lock);
+      munmap(v->addr, v->len);
+      return -1;
+    }
+    kdup((void*)s->pages[i]);
+  }
+  release(&shm.lock);
+  return v->addr;
+}
+
+// Detach the segment mapped at addr from the current process.
+int
+shmdt(uint64 addr)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && v->f == 0 && v->addr == addr)
+      return munmap(v->addr, v->len);
+  }
+  return -1;
+}
+
+// Remove the segment with the given key.
+// Processes that still have it attached keep its pages
+// until they detach.
+int
+shmrm(int key)
+{
+  struct shmseg *s;
+
+  acquire(&shm.lock);
+  for(s = shm.seg; s < &shm.seg[NSHM]; s++){
+    if(s->used && s->key == key){
+      shmfree(s);
+      release(&shm.lock);
+      return 0;
+    }
+  }
+  release(&shm.lock);
+  return -1;
+}
@@ -43,9 +43,14 @@ memmove(void *dst, const void *src, uint n)
     d += n;
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    // a word at a time while both are 8-byte aligned.
+    if((((uint64)s | (uint64)d) & 7) == 0)
+      for(; n >= 8; n -= 8, s += 8, d += 8)
+        *(uint64*)d = *(const uint64*)s;
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -0,0 +1,308 @@
+//
+// Paging user memory out to a swap area on the disk.
+//
+// The swap area is the part of the disk after the file
+// system (sb.size), divided into page-sized slots. When
+// kalloc() runs dry, uvmkalloc() calls swapout() to write a
+// user page to a free slot and reuse its memory. The page's
+// PTE keeps its permissions, loses PTE_V, gains PTE_SWAP,
+// and holds the slot number where the PPN was; the next
+// touch faults into vmfault(), which calls swapin().
+//
+// swapout() picks pages like the hand of a clock sweeping
+// over every process's user memory: a page whose PTE_A bit is
+// set was used since the hand last passed, so it gets another
+// chance with the bit cleared. Only private pages (a single
+// reference) are taken, and only from the current process or
+// from sleeping ones, which can't be in the middle of using a
+// page that the kernel found for them, and can't be using a
+// stale TLB entry until they run again.
+//
+// Pages that compress well are kept compressed in memory by
+// zram.c instead of going to the disk. Slots below nslot
+// have room on the disk; the rest of the NSWAP slots can
+// only hold compressed pages.
+//
+// A slot is referenced by every PTE that names it; fork()
+// shares swapped-out pages with the child that way.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "proc.h"
+
+struct {
+  struct spinlock lock;
+  uint start;            // First block of the swap area
+  int nslot;             // Number of slots on the disk
+  uchar ref[NSWAP];      // PTEs naming each slot, 0 if free
+  uchar busy[NSWAP];     // Slot is being written
+
+  struct spinlock handlock; // protects hand and handva
+  int hand;              // Clock hand: process...
+  uint64 handva;         // ...and address in it
+
+  struct sleeplock iolock; // protects buf
+  struct buf buf;
+} swap;
+
+// Use the part of the disk after the file system's size
+// blocks as swap space.
+void
+swapinit(uint size)
+{
+  uint64 cap;
+
+  initlock(&swap.lock, "swap");
+  initlock(&swap.handlock, "swaphand");
+  initsleeplock(&swap.iolock, "swapio");
+  swap.start = size;
+  cap = virtio_disk_capacity();
+  if(cap > size)
+    swap.nslot = (cap - size) / (PGSIZE / BSIZE);
+  if(swap.nslot > NSWAP)
+    swap.nslot = NSWAP;
+}
+
+// Allocate a slot: one with room on the disk if disk is
+// set, otherwise preferably one without.
+static int
+slotalloc(int disk)
+{
+  int i, n, s;
+
+  n = disk ? swap.nslot : NSWAP;
+  acquire(&swap.lock);
+  for(i = 0; i < n; i++){
+    s = disk ? i : (swap.nslot + i) % NSWAP;
+    if(swap.ref[s] == 0 && swap.busy[s] == 0){
+      swap.ref[s] = 1;
+      swap.busy[s] = 1;
+      release(&swap.lock);
+      return s;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Give back a slot that slotalloc() returned but that
+// wasn't used.
+static void
+slotput(int slot)
+{
+  acquire(&swap.lock);
+  swap.ref[slot] = 0;
+  swap.busy[slot] = 0;
+  release(&swap.lock);
+}
+
+// Find a slot for the user page at pa, and keep the page in
+// memory compressed if it can be. Returns the slot, or -1.
+// Sets *z to what zstore() returned.
+static int
+slotfor(uint64 pa, int *z)
+{
+  int slot;
+
+  *z = -1;
+  if((slot = slotalloc(0)) < 0)
+    return -1;
+  if((*z = zstore(slot, pa)) >= 0 || slot < swap.nslot)
+    return slot;
+  slotput(slot);
+  return slotalloc(1);
+}
+
+// Another PTE names slot.
+void
+swapdup(int slot)
+{
+  acquire(&swap.lock);
+  if(swap.ref[slot] == 255)
+    panic("swapdup");
+  swap.ref[slot]++;
+  release(&swap.lock);
+}
+
+// A PTE naming slot went away.
+void
+swapfree(int slot)
+{
+  acquire(&swap.lock);
+  if(swap.ref[slot] < 1)
+    panic("swapfree");
+  if(--swap.ref[slot] == 0)
+    zfree(slot);
+  release(&swap.lock);
+}
+
+// Read or write the page at pa from or to slot.
+static void
+swapio(int slot, char *pa, int write)
+{
+  int i;
+
+  acquiresleep(&swap.iolock);
+  for(i = 0; i < PGSIZE / BSIZE; i++){
+    swap.buf.dev = ROOTDEV;
+    swap.buf.blockno = swap.start + slot * (PGSIZE / BSIZE) + i;
+    if(write)
+      memmove(swap.buf.data, pa + i * BSIZE, BSIZE);
+    virtio_disk_rw(&swap.buf, write);
+    if(!write)
+      memmove(pa + i * BSIZE, swap.buf.data, BSIZE);
+  }
+  releasesleep(&swap.iolock);
+}
+
+// Advance the clock hand over p's user memory to the next
+// page that can be evicted, and return its PTE, or 0 if
+// the hand has reached p->sz. Caller holds swap.handlock
+// and p->lock.
+static pte_t*
+clockscan(struct proc *p)
+{
+  pagetable_t pt;
+  pte_t *pte;
+  uint64 va;
+
+  for(va = swap.handva; va < p->sz; ){
+    // skip the holes in the address space a whole
+    // page-table page at a time.
+    pte = &p->pagetable[PX(2, va)];
+    if((*pte & PTE_V) == 0){
+      va = (va + (1L << PXSHIFT(2))) & ~((1L << PXSHIFT(2)) - 1);
+      continue;
+    }
+    pt = (pagetable_t)PTE2PA(*pte);
+    pte = &pt[PX(1, va)];
+    if((*pte & PTE_V) == 0 || PTE_LEAF(*pte)){
+      va = (va + (1L << PXSHIFT(1))) & ~((1L << PXSHIFT(1)) - 1);
+      continue;
+    }
+    pt = (pagetable_t)PTE2PA(*pte);
+    pte = &pt[PX(0, va)];
+    va += PGSIZE;
+
+    if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+      continue;
+    if(*pte & PTE_A){
+      *pte &= ~PTE_A;
+      continue;
+    }
+    if(krefcnt((void*)PTE2PA(*pte)) != 1)
+      continue;
+    swap.handva = va;
+    return pte;
+  }
+  return 0;
+}
+
+// Evict one user page to swap, to make room in memory.
+// Returns 0, or -1 if there is nothing to evict, no free
+// slot, or the caller holds a spinlock and can't wait for
+// the disk.
+int
+swapout(void)
+{
+  struct proc *p;
+  struct vmacct *a;
+  pte_t *pte;
+  uint64 pa;
+  int slot, n, z, locks;
+
+  push_off();
+  locks = mycpu()->noff - 1;
+  pop_off();
+  if(locks > 0)
+    return -1;
+
+  // two turns, in case the first only clears PTE_A bits.
+  acquire(&swap.handlock);
+  for(n = 0; n <= 2*NPROC; n++){
+    p = &proc[swap.hand];
+    acquire(&p->lock);
+    pte = 0;
+    if(p->pagetable && (p == myproc() || p->state == SLEEPING)){
+      // pass over pages that neither compress nor fit on
+      // the disk.
+      while((pte = clockscan(p)) != 0 &&
+            (slot = slotfor(PTE2PA(*pte), &z)) < 0)
+        ;
+    }
+    if(pte){
+      pa = PTE2PA(*pte);
+      *pte = PA2PTE((uint64)slot * PGSIZE) | PTE_SWAP |
+             (PTE_FLAGS(*pte) & ~(PTE_V|PTE_A|PTE_D));
+      if((a = vmacct(p->pagetable)) != 0){
+        __sync_fetch_and_sub(&a->rss, 1);
+        __sync_fetch_and_add(&a->swap, 1);
+      }
+      if(p == myproc())
+        uvmstale(p->pagetable);
+      else
+        __sync_fetch_and_or(&p->tlbstale, ~0L);
+      release(&p->lock);
+      release(&swap.handlock);
+
+      if(z < 0)
+        swapio(slot, (char*)pa, 1);
+      if(z != 1)
+        kfree((void*)pa);
+      acquire(&swap.lock);
+      swap.busy[slot] = 0;
+      wakeup(&swap.busy[slot]);
+      release(&swap.lock);
+      return 0;
+    }
+    release(&p->lock);
+    swap.hand = (swap.hand + 1) % NPROC;
+    swap.handva = 0;
+  }
+  release(&swap.handlock);
+  return -1;
+}
+
+// Read a swapped-out page of the current process back in,
+// after a page fault. pte is its PTE in pagetable. The page
+// is private once read in, so a copy-on-write page becomes
+// writable.
+// Returns the physical address of the page, or 0 if out
+// of memory.
+uint64
+swapin(pagetable_t pagetable, pte_t *pte)
+{
+  int slot = PTE2PA(*pte) / PGSIZE;
+  struct vmacct *a;
+  uint flags;
+  char *mem;
+
+  if((mem = uvmkalloc()) == 0)
+    return 0;
+
+  // wait until the page is all on the disk.
+  acquire(&swap.lock);
+  while(swap.busy[slot])
+    sleep(&swap.busy[slot], &swap.lock);
+  release(&swap.lock);
+
+  if(zload(slot, (uint64)mem) < 0)
+    swapio(slot, mem, 0);
+  flags = PTE_FLAGS(*pte) & ~PTE_SWAP;
+  if(flags & PTE_COW)
+    flags = (flags & ~PTE_COW) | PTE_W;
+  *pte = PA2PTE(mem) | flags | PTE_V;
+  if((a = vmacct(pagetable)) != 0){
+    __sync_fetch_and_add(&a->rss, 1);
+    __sync_fetch_and_sub(&a->swap, 1);
+  }
+  swapfree(slot);
+  return (uint64)mem;
+}
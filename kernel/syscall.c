@@ -109,6 +109,16 @@ extern uint64 sys_set_priority(void);//
 extern uint64 sys_settickets(void);  //
 extern uint64 sys_waitx(void);       //
 ///////////////////////////////////////
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_shmget(void);
+extern uint64 sys_shmat(void);
+extern uint64 sys_shmdt(void);
+extern uint64 sys_shmrm(void);
+extern uint64 sys_memstat(void);
+extern uint64 sys_memlimit(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_fallocate(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -140,15 +150,26 @@ static uint64 (*syscalls[])(void) = {
 [SYS_sigreturn] sys_sigreturn,     // ADDING SIGRETURN
 [SYS_set_priority]sys_set_priority,//
 [SYS_settickets] sys_settickets,   //
-[SYS_waitx]      sys_waitx         //
+[SYS_waitx]      sys_waitx,        //
 /////////////////////////////////////
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_shmget]  sys_shmget,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_shmrm]   sys_shmrm,
+[SYS_memstat] sys_memstat,
+[SYS_memlimit] sys_memlimit,
+[SYS_fsync]   sys_fsync,
+[SYS_fallocate] sys_fallocate,
 
 };
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 char* sysnames[] = {"NIL","fork","exit","wait","pipe","read","kill","exec","fstat","chdir","dup","getpid",                          //
-                    "sbrk","sleep","uptime","open","write","mknod","unlink","link","mkdir","close","trace","sigalarm","sigreturn","set_priority"}; //
+                    "sbrk","sleep","uptime","open","write","mknod","unlink","link","mkdir","close","trace","sigalarm","sigreturn","set_priority",   //
+                    "settickets","waitx","mmap","munmap","shmget","shmat","shmdt","shmrm","memstat","memlimit","fsync","fallocate"};//
                                                                                                                                     //
-int sysargc[] = {0,0,1,1,1,3,1,2,2,1,1,0,1,1,0,2,3,3,1,2,1,1,1,2,0,2};                                                                //
+int sysargc[] = {0,0,1,1,1,3,1,2,2,1,1,0,1,1,0,2,3,3,1,2,1,1,1,2,0,2,1,3,6,2,2,1,1,1,2,1,1,2};                                      //
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // a0 -> command index after trace and return value after exec so we need to store value of a0 temporary after trace and before exec//
 // a7 -> system call index                                                                                                          //
@@ -195,6 +216,10 @@ syscall(void)
         {                                       
           printf("(%d %d %d) -> %d\n",com_index,p->trapframe->a1,p->trapframe->a2,ret_val);
         }
+        else                                    // more than three, print the first three
+        {
+          printf("(%d %d %d ...) -> %d\n",com_index,p->trapframe->a1,p->trapframe->a2,ret_val);
+        }
        }
     }
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -27,3 +27,13 @@
 #define SYS_set_priority 25
 #define SYS_settickets 26
 #define SYS_waitx  27
+#define SYS_mmap   28
+#define SYS_munmap 29
+#define SYS_shmget 30
+#define SYS_shmat  31
+#define SYS_shmdt  32
+#define SYS_shmrm  33
+#define SYS_memstat  34
+#define SYS_memlimit 35
+#define SYS_fsync    36
+#define SYS_fallocate 37
@@ -107,6 +107,33 @@ sys_close(void)
   return 0;
 }
 
+// Return once everything written to fd's file, and every
+// other finished change to the file system, is on disk.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  log_sync();
+  return 0;
+}
+
+// Allocate disk blocks for the first len bytes of fd's file
+// now, in a row if possible.
+uint64
+sys_fallocate(void)
+{
+  struct file *f;
+  uint64 len;
+
+  argaddr(1, &len);
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return fileallocate(f, len);
+}
+
 uint64
 sys_fstat(void)
 {
@@ -474,6 +501,32 @@ sys_exec(void)
   return -1;
 }
 
+uint64
+sys_mmap(void)
+{
+  struct file *f;
+  uint64 len, off;
+  int prot, flags;
+
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argaddr(5, &off);
+  if(argfd(4, 0, &f) < 0)
+    return -1;
+  return mmap(f, len, prot, flags, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
+
 uint64
 sys_pipe(void)
 {
@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "memstat.h"
 
 uint64
 sys_exit(void)
@@ -188,6 +189,93 @@ sys_settickets(void)
 }
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+uint64
+sys_shmget(void)
+{
+  int key;
+  uint64 sz;
+
+  argint(0, &key);
+  argaddr(1, &sz);
+  return shmget(key, sz);
+}
+
+uint64
+sys_shmat(void)
+{
+  int id;
+
+  argint(0, &id);
+  return shmat(id);
+}
+
+uint64
+sys_shmdt(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return shmdt(addr);
+}
+
+uint64
+sys_shmrm(void)
+{
+  int key;
+
+  argint(0, &key);
+  return shmrm(key);
+}
+
+// Copy process pid's memory counters to the struct memstat
+// at the user address given, or the caller's if pid is 0.
+uint64
+sys_memstat(void)
+{
+  int pid;
+  uint64 addr;
+  struct memstat st;
+  struct vmacct *a;
+  struct proc *p;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->pagetable && (a = vmacct(p->pagetable)) != 0){
+      st.rss = a->rss;
+      st.swap = a->swap;
+      st.ptpages = a->ptpages;
+      st.kpages = 3;  // kernel stack, trapframe and its copy
+      st.limit = p->memlimit;
+      release(&p->lock);
+      return copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st));
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Limit the calling process, and the children it forks, to
+// n user pages. A process without a limit can set one, and
+// a limited one can only lower it, not raise or lift it.
+// Returns the old limit.
+uint64
+sys_memlimit(void)
+{
+  int n, old;
+  struct proc *p = myproc();
+
+  argint(0, &n);
+  if(n <= 0 || (p->memlimit && n > p->memlimit))
+    return -1;
+  old = p->memlimit;
+  p->memlimit = n;
+  return old;
+}
+
 //////////////////////////////////
 uint64
 sys_waitx(void)
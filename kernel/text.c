@@ -0,0 +1,169 @@
+//
+// Cache of read-only program pages.
+//
+// segfault() looks here before reading a page of a
+// non-writable segment (program text and rodata) from the
+// executable, and exec() maps the pages that are already
+// cached straight into the new image. Processes running the
+// same program therefore share one physical copy of its
+// text, and a second exec() of it reads nothing from disk.
+//
+// Pages are identified by device, inode number and file
+// offset. The cache holds one reference to each page; every
+// process that maps it holds another. writei() and itrunc()
+// drop a file's pages from the cache, so later exec()s see
+// the new contents, while processes already running keep the
+// page they have mapped. When the cache is full, a page that
+// no process has mapped is evicted first.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "proc.h"
+
+struct tpage {
+  uint dev;
+  uint inum;        // 0 if the slot is free
+  uint off;         // File offset of the page
+  uint n;           // Bytes read from the file; the rest is zero
+  uint64 pa;
+};
+
+struct {
+  struct spinlock lock;
+  struct tpage page[NTEXT];
+  int hand;         // Next slot to consider for eviction
+} text;
+
+void
+textinit(void)
+{
+  initlock(&text.lock, "text");
+}
+
+static struct tpage*
+textlookup(struct inode *ip, uint off, uint n)
+{
+  struct tpage *t;
+
+  for(t = text.page; t < &text.page[NTEXT]; t++)
+    if(t->inum == ip->inum && t->dev == ip->dev && t->off == off && t->n == n)
+      return t;
+  return 0;
+}
+
+// Return the cached page holding n bytes of ip at off,
+// with a reference for the caller, or 0 if it isn't cached.
+uint64
+textget(struct inode *ip, uint off, uint n)
+{
+  struct tpage *t;
+  uint64 pa = 0;
+
+  acquire(&text.lock);
+  if((t = textlookup(ip, off, n)) != 0){
+    pa = t->pa;
+    kdup((void*)pa);
+  }
+  release(&text.lock);
+  return pa;
+}
+
+// Add the page at pa, holding n bytes of ip at off, to the
+// cache. The caller must hold ip->lock and keeps its own
+// reference to the page.
+void
+textput(struct inode *ip, uint off, uint n, uint64 pa)
+{
+  struct tpage *t;
+  int i;
+
+  acquire(&text.lock);
+  if(textlookup(ip, off, n) != 0){
+    // another process read the same page first.
+    release(&text.lock);
+    return;
+  }
+
+  t = 0;
+  for(i = 0; i < NTEXT; i++){
+    t = &text.page[(text.hand + i) % NTEXT];
+    if(t->inum == 0 || krefcnt((void*)t->pa) == 1)
+      break;
+  }
+  if(i == NTEXT)
+    t = &text.page[text.hand];
+  text.hand = (t - text.page + 1) % NTEXT;
+  if(t->inum != 0)
+    kfree((void*)t->pa);
+
+  kdup((void*)pa);
+  t->dev = ip->dev;
+  t->inum = ip->inum;
+  t->off = off;
+  t->n = n;
+  t->pa = pa;
+  ip->text = 1;
+  release(&text.lock);
+}
+
+// Map the cached pages of program segment s of ip into
+// pagetable. Pages that aren't cached are left for segfault().
+// The caller must hold ip->lock.
+// Returns 0 on success, -1 if out of memory.
+int
+textmap(pagetable_t pagetable, struct inode *ip, struct seg *s)
+{
+  struct tpage *t;
+  uint pgoff, n;
+
+  acquire(&text.lock);
+  for(t = text.page; t < &text.page[NTEXT]; t++){
+    if(t->inum != ip->inum || t->dev != ip->dev)
+      continue;
+    if(t->off < s->off || t->off - s->off >= s->filesz)
+      continue;
+    pgoff = t->off - s->off;
+    if(pgoff % PGSIZE != 0)
+      continue;
+    if(s->filesz - pgoff < PGSIZE)
+      n = s->filesz - pgoff;
+    else
+      n = PGSIZE;
+    if(t->n != n)
+      continue;
+    if(mappages(pagetable, s->va + pgoff, PGSIZE, t->pa, PTE_R|PTE_U|s->perm) != 0){
+      release(&text.lock);
+      return -1;
+    }
+    kdup((void*)t->pa);
+  }
+  release(&text.lock);
+  return 0;
+}
+
+// Drop ip's pages from the cache, because the file's
+// contents are changing. The caller must hold ip->lock.
+void
+textinval(struct inode *ip)
+{
+  struct tpage *t;
+
+  if(ip->text == 0)
+    return;
+  acquire(&text.lock);
+  for(t = text.page; t < &text.page[NTEXT]; t++){
+    if(t->inum == ip->inum && t->dev == ip->dev){
+      kfree((void*)t->pa);
+      t->inum = 0;
+    }
+  }
+  ip->text = 0;
+  release(&text.lock);
+}
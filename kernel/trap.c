@@ -10,6 +10,7 @@ struct spinlock tickslock;
 uint ticks;
 
 extern char trampoline[], uservec[], userret[];
+extern char uaccess_fault[], uaccess_end[];
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
@@ -65,6 +66,10 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if((r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p->pagetable, r_stval(), r_scause() == 15) != 0){
+    // page fault on a lazily-allocated heap page,
+    // or a store to a copy-on-write page.
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -144,8 +149,9 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to,
+  // and the ASID to run it under.
+  uint64 satp = uvmsatp(p);
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -169,6 +175,24 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
+#ifdef KERNMAP
+  if((scause == 13 || scause == 15) &&
+     sepc >= (uint64)uaccess_copy && sepc < (uint64)uaccess_end){
+    // copyin() or copyout() touched a user page that isn't
+    // there yet, or is copy-on-write. retry once vmfault()
+    // has dealt with it, or make the copy return -1.
+    uint64 va = r_stval();
+    if(sstatus & SSTATUS_SPIE)
+      intr_on();
+    if(vmfault(myproc()->pagetable, va, scause == 15) == 0)
+      sepc = (uint64)uaccess_fault;
+    intr_off();
+    w_sepc(sepc);
+    w_sstatus(sstatus);
+    return;
+  }
+#endif
+
   if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -19,6 +19,9 @@
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
 
+// block i of a virtio_disk_rwv() batch.
+#define BLOCKNO(b, blockno, i) ((blockno) ? (blockno)[i] : (b)[i]->blockno)
+
 static struct disk {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
@@ -40,6 +43,7 @@ static struct disk {
 
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
+  struct buf *dbuf[NUM]; // buf whose data a descriptor points to
   uint16 used_idx; // we've looked this far in used[2..NUM].
 
   // track info about in-flight operations,
@@ -48,6 +52,7 @@ static struct disk {
   struct {
     struct buf *b;
     char status;
+    char async;    // virtio_disk_intr() finishes the request
   } info[NUM];
 
   // disk command headers.
@@ -152,6 +157,18 @@ virtio_disk_init(void)
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
+// size of the disk, in BSIZE blocks.
+uint64
+virtio_disk_capacity(void)
+{
+  uint64 sectors;
+
+  // the first field of a block device's configuration is its
+  // capacity in 512-byte sectors, as a 64-bit number.
+  sectors = *R(VIRTIO_MMIO_CONFIG) | ((uint64)*R(VIRTIO_MMIO_CONFIG + 4) << 32);
+  return sectors / (BSIZE / 512);
+}
+
 // find a free descriptor, mark it non-free, return its index.
 static int
 alloc_desc()
@@ -196,12 +213,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -212,27 +228,27 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// hand the device a request to read or write n bufs, which
+// hold consecutive blocks, starting at block blockno.
+// returns the first descriptor of the request, or -1 if
+// there aren't enough free descriptors.
+// caller holds vdisk_lock.
+static int
+disk_start(struct buf **b, int n, uint blockno, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  uint64 sector = blockno * (BSIZE / 512);
 
   // the spec's Section 5.2 says that legacy block operations use
   // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
+  // data, one for a 1-byte status result. the data may be
+  // split over several descriptors, one per buf.
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
+  // allocate the descriptors.
+  int idx[NUM];
+  if(n + 2 > NUM || allocn_desc(idx, n + 2) != 0)
+    return -1;
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -249,24 +265,29 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 1; i <= n; i++){
+    b[i-1]->disk = 1;
+    disk.dbuf[idx[i]] = b[i-1];
+    disk.desc[idx[i]].addr = (uint64) b[i-1]->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record struct buf for virtio_disk_intr(). the first buf
+  // stands for the whole request.
+  disk.info[idx[0]].b = b[0];
+  disk.info[idx[0]].async = 0;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
@@ -280,17 +301,108 @@ virtio_disk_rw(struct buf *b, int write)
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
+  return idx[0];
+}
+
+// wait for the request at descriptor id, started for b,
+// and free its descriptors.
+// caller holds vdisk_lock.
+static void
+disk_finish(struct buf *b, int id)
+{
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  disk.info[id].b = 0;
+  free_chain(id);
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  int id;
+
+  acquire(&disk.vdisk_lock);
+
+  while((id = disk_start(&b, 1, b->blockno, write)) < 0)
+    sleep(&disk.free[0], &disk.vdisk_lock);
+  disk_finish(b, id);
 
   release(&disk.vdisk_lock);
 }
 
+// read or write n bufs at once, to blocks blockno[0..n-1],
+// or to the bufs' own blocks if blockno is 0.
+// each run of consecutive blocks goes to the device as one
+// request, and all the requests are outstanding together,
+// so that the whole batch takes about one round trip.
+void
+virtio_disk_rwv(struct buf **b, uint *blockno, int n, int write)
+{
+  struct {
+    struct buf *b;
+    int id;
+  } req[NUM];
+  int i, k, nreq = 0, head = 0;
+
+  acquire(&disk.vdisk_lock);
+  for(i = 0; i < n; i += k){
+    // the run of consecutive blocks starting at i.
+    for(k = 1; i + k < n && k < NUM/2 - 2; k++){
+      if(BLOCKNO(b, blockno, i+k) != BLOCKNO(b, blockno, i) + k)
+        break;
+    }
+    while((req[nreq % NUM].id = disk_start(b+i, k, BLOCKNO(b, blockno, i), write)) < 0){
+      // out of descriptors: wait for one of our own
+      // requests, if any, else for someone else's.
+      if(head < nreq){
+        disk_finish(req[head % NUM].b, req[head % NUM].id);
+        head++;
+      } else {
+        sleep(&disk.free[0], &disk.vdisk_lock);
+      }
+    }
+    req[nreq % NUM].b = b[i];
+    nreq++;
+  }
+  for(; head < nreq; head++)
+    disk_finish(req[head % NUM].b, req[head % NUM].id);
+  release(&disk.vdisk_lock);
+}
+
+// start reading n bufs, which hold consecutive blocks, from
+// disk, in one request, for read-ahead, but don't wait:
+// virtio_disk_intr() sets each buf's valid when the data is
+// in, and virtio_disk_wait() waits for that.
+// returns 0, or -1 if the queue is full, rather than wait
+// for room, since read-ahead is only worth it if it's quick.
+int
+virtio_disk_read_async(struct buf **b, int n)
+{
+  int i, nfree, id = -1;
+
+  acquire(&disk.vdisk_lock);
+  // leave a request's worth of descriptors for virtio_disk_rw().
+  for(i = nfree = 0; i < NUM; i++)
+    nfree += disk.free[i];
+  if(nfree >= n + 2 + 3 && (id = disk_start(b, n, b[0]->blockno, 0)) >= 0)
+    disk.info[id].async = 1;
+  release(&disk.vdisk_lock);
+  return id < 0 ? -1 : 0;
+}
+
+// wait for a virtio_disk_read_async() of b to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  while(b->disk == 1)
+    sleep(b, &disk.vdisk_lock);
+  release(&disk.vdisk_lock);
+}
+
 void
 virtio_disk_intr()
 {
@@ -316,9 +428,20 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    // disk is done with the request's bufs.
+    for(int d = disk.desc[id].next; disk.desc[d].flags & VRING_DESC_F_NEXT; d = disk.desc[d].next){
+      struct buf *b = disk.dbuf[d];
+      if(disk.info[id].async)
+        b->valid = 1;
+      b->disk = 0;
+      wakeup(b);
+    }
+    if(disk.info[id].async){
+      // no one is waiting to clean up after a read-ahead.
+      disk.info[id].b = 0;
+      disk.info[id].async = 0;
+      free_chain(id);
+    }
 
     disk.used_idx += 1;
   }
@@ -4,6 +4,8 @@
 #include "elf.h"
 #include "riscv.h"
 #include "defs.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "fs.h"
 
 /*
@@ -15,6 +17,50 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// Address-space identifiers (ASIDs) tag TLB entries, so that
+// the TLB can keep translations for the kernel (ASID 0) and
+// for several processes at once across traps and context
+// switches. Each process gets an ASID from 1 to max. When they
+// run out, a new generation starts: processes get fresh ASIDs
+// the next time they return to user space, and each hart
+// flushes its whole TLB before it uses the new generation.
+struct {
+  struct spinlock lock;
+  uint64 gen;
+  int next;
+  int max;        // largest ASID the hardware keeps, 0 if none
+} asids;
+
+// Page counts for every user page table: each process's,
+// one exec() may be building for it, and one the reaper
+// hasn't freed yet.
+struct {
+  struct spinlock lock;
+  struct vmacct acct[3*NPROC];
+} vmaccts;
+
+static pte_t *walklevel(pagetable_t, uint64, int, int);
+
+// Return the memory counters of user page table pagetable,
+// or 0 if it is the kernel's.
+struct vmacct *
+vmacct(pagetable_t pagetable)
+{
+  struct vmacct *a;
+
+  for(a = vmaccts.acct; a < &vmaccts.acct[NELEM(vmaccts.acct)]; a++)
+    if(a->pagetable == pagetable)
+      return a;
+  return 0;
+}
+
+#ifdef KERNMAP
+// the kernel's mappings are the same in every page table.
+#define KPTE_G PTE_G
+#else
+#define KPTE_G 0
+#endif
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -37,6 +83,7 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // past the first 2-megabyte boundary, this is all megapages.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -54,6 +101,9 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&asids.lock, "asid");
+  asids.gen = 1;
+  asids.next = 1;
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -64,12 +114,152 @@ kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
+  // find out how many ASID bits the hardware keeps.
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(SATP_ASIDMAX));
+  asids.max = SATP2ASID(r_satp());
   w_satp(MAKE_SATP(kernel_pagetable));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Give p an ASID from the current generation, if it doesn't
+// have one. Every hart must then flush p's ASID before
+// running p, since a new page table, or an earlier owner of
+// the ASID, may have left translations behind.
+void
+asidalloc(struct proc *p)
+{
+  acquire(&asids.lock);
+  if(asids.max == 0){
+    p->asid = 0;
+  } else if(p->asidgen != asids.gen){
+    if(asids.next > asids.max){
+      asids.gen++;
+      asids.next = 1;
+    }
+    p->asid = asids.next++;
+    p->asidgen = asids.gen;
+  }
+  release(&asids.lock);
+  __sync_fetch_and_or(&p->tlbstale, ~0L);
+}
+
+// Return the satp value that runs p's page table under its
+// ASID, first flushing this hart's TLB of p's translations
+// if they may be stale. Called with interrupts off.
+uint64
+uvmsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 bit = 1L << cpuid();
+
+  // without ASIDs, userret flushes the whole TLB.
+  if(asids.max == 0)
+    return MAKE_SATP(p->pagetable);
+
+  if(p->asidgen != asids.gen)
+    asidalloc(p);
+  if(c->asidgen < p->asidgen){
+    // ASIDs have been handed out again since this
+    // hart last flushed them all.
+    sfence_vma();
+    c->asidgen = p->asidgen;
+    __sync_fetch_and_and(&p->tlbstale, ~bit);
+  } else if(p->tlbstale & bit){
+    sfence_vma_asid(p->asid);
+    __sync_fetch_and_and(&p->tlbstale, ~bit);
+  }
+  return MAKE_SATP(p->pagetable) | SATP_ASID(p->asid);
+}
+
+// PTEs of pagetable were removed or lost permissions. If it
+// is the current process's, every hart must flush the
+// process's ASID before running it in user space again.
+// Other user page tables are not running, and asidalloc()
+// has them flushed before they do.
+void
+uvmstale(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable){
+    __sync_fetch_and_or(&p->tlbstale, ~0L);
+#ifdef KERNMAP
+    // the kernel runs on this page table, and may touch
+    // user memory through it before returning to user space.
+    push_off();
+    uvmswitch(p);
+    pop_off();
+#endif
+  }
+}
+
+#ifdef KERNMAP
+// Switch this hart to p's page table, which maps the kernel
+// as well, or to the kernel's own page table if p is 0.
+// Called with interrupts off.
+void
+uvmswitch(struct proc *p)
+{
+  if(p == 0 || p->pagetable == 0)
+    w_satp(MAKE_SATP(kernel_pagetable));
+  else
+    w_satp(uvmsatp(p));
+  if(asids.max == 0)
+    sfence_vma();
+}
+
+// Map the kernel into user page table pagetable, without
+// PTE_U: RAM by sharing the kernel's page-table page for
+// its gigabyte, the devices by sharing its entries for them
+// in the first gigabyte, and the kernel stacks by copying
+// their PTEs. Returns 0, or -1 if out of memory.
+int
+kvmshare(pagetable_t pagetable)
+{
+  pagetable_t kpt, upt;
+  pte_t *pte;
+  int i;
+
+  pagetable[PX(2, KERNBASE)] = kernel_pagetable[PX(2, KERNBASE)];
+
+  if((pte = walklevel(pagetable, PLIC, 1, 1)) == 0)
+    return -1;
+  upt = (pagetable_t)(pte - PX(1, PLIC));
+  kpt = (pagetable_t)PTE2PA(kernel_pagetable[PX(2, PLIC)]);
+  for(i = PX(1, PLIC); i <= PX(1, VIRTIO0); i++)
+    upt[i] = kpt[i];
+
+  for(i = 0; i < NPROC; i++){
+    if((pte = walk(pagetable, KSTACK(i), 1)) == 0)
+      return -1;
+    *pte = *walk(kernel_pagetable, KSTACK(i), 0);
+  }
+  return 0;
+}
+
+// Undo kvmshare(), so that freewalk() doesn't free
+// the kernel's page-table pages.
+void
+kvmunshare(pagetable_t pagetable)
+{
+  pte_t *pte;
+  int i;
+
+  pagetable[PX(2, KERNBASE)] = 0;
+  if((pte = walklevel(pagetable, PLIC, 0, 1)) != 0){
+    pte -= PX(1, PLIC);
+    for(i = PX(1, PLIC); i <= PX(1, VIRTIO0); i++)
+      pte[i] = 0;
+  }
+  for(i = 0; i < NPROC; i++){
+    if((pte = walk(pagetable, KSTACK(i), 0)) != 0)
+      *pte = 0;
+  }
+}
+#endif
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -82,24 +272,42 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// If va lies in a megapage, returns its level-1 leaf PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but return the PTE for va in the page-table
+// page at the given level. A leaf PTE at level 1 maps a
+// 2-megabyte megapage.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int level)
+{
+  pagetable_t root = pagetable;
+  struct vmacct *a;
+
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)uvmkalloc()) == 0)
         return 0;
       memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
+      if((a = vmacct(root)) != 0)
+        __sync_fetch_and_add(&a->ptpages, 1);
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(level, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -128,11 +336,29 @@ walkaddr(pagetable_t pagetable, uint64 va)
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// uses a megapage for every 2-megabyte-aligned stretch,
+// and 4096-byte pages for the rest.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
-    panic("kvmmap");
+  uint64 a, end, n;
+  pte_t *pte;
+
+  end = PGROUNDUP(va + sz);
+  for(a = PGROUNDDOWN(va); a < end; a += n, pa += n){
+    if(a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && end - a >= MEGAPGSIZE){
+      n = MEGAPGSIZE;
+      if((pte = walklevel(kpgtbl, a, 1, 1)) == 0)
+        panic("kvmmap");
+      if(*pte & PTE_V)
+        panic("kvmmap: remap");
+      *pte = PA2PTE(pa) | perm | PTE_V | KPTE_G;
+    } else {
+      n = PGSIZE;
+      if(mappages(kpgtbl, a, PGSIZE, pa, perm | KPTE_G) != 0)
+        panic("kvmmap");
+    }
+  }
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
@@ -144,9 +370,12 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
   uint64 a, last;
   pte_t *pte;
+  struct vmacct *acct = 0;
 
   if(size == 0)
     panic("mappages: size");
+  if(perm & PTE_U)
+    acct = vmacct(pagetable);
   
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
@@ -156,6 +385,8 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
+    if(acct)
+      __sync_fetch_and_add(&acct->rss, 1);
     if(a == last)
       break;
     a += PGSIZE;
@@ -165,30 +396,90 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never touched by a lazily
+// allocated process have no mapping, and are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
   uint64 a;
   pte_t *pte;
+  int unmapped = 0;
+  struct vmacct *acct = vmacct(pagetable);
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+    if((pte = walk(pagetable, a, 0)) == 0){
+      // no page-table page: skip the rest of its range.
+      a = ((a + MEGAPGSIZE) & ~(MEGAPGSIZE - 1)) - PGSIZE;
+      continue;
+    }
+    if(*pte & PTE_SWAP){
+      swapfree(PTE2PA(*pte) / PGSIZE);
+      *pte = 0;
+      if(acct)
+        __sync_fetch_and_sub(&acct->swap, 1);
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(acct && (*pte & PTE_U))
+      __sync_fetch_and_sub(&acct->rss, 1);
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
     *pte = 0;
+    unmapped = 1;
   }
+  if(unmapped)
+    uvmstale(pagetable);
+}
+
+// Allocate a page of memory for a user page, or for one of
+// a user page table's pages. If memory is short, make room
+// by freeing a dead process's memory that the reaper hasn't
+// got to yet, or else by paging out some other user page,
+// and only then by shrinking the disk block cache, so that a
+// process that uses a lot of memory doesn't empty it.
+// That may sleep, so a caller holding a spinlock just gets
+// what kalloc() has; allocproc() and fork() build the new
+// process's page table without holding its lock.
+// Returns 0 if out of memory and swap.
+void *
+uvmkalloc(void)
+{
+  void *mem;
+  int locks;
+
+  push_off();
+  locks = mycpu()->noff - 1;
+  pop_off();
+
+  while((mem = kalloc()) == 0){
+    if(locks > 0 || myproc() == 0)
+      return 0;
+    if(reapnow() < 0 && swapout() < 0 && bshrink() < 0)
+      return 0;
+  }
+  return mem;
+}
+
+// Would n more user pages take process p past its memory
+// limit? Counts the pages it has in memory and in swap, so
+// that paging some out doesn't make room for more.
+int
+uvmoverlimit(struct proc *p, uint64 n)
+{
+  struct vmacct *a;
+
+  if(p->memlimit == 0 || (a = vmacct(p->pagetable)) == 0)
+    return 0;
+  return a->rss + a->swap + n > p->memlimit;
 }
 
 // create an empty user page table.
@@ -197,10 +488,24 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  struct vmacct *a;
+
+  pagetable = (pagetable_t) uvmkalloc();
   if(pagetable == 0)
     return 0;
   memset(pagetable, 0, PGSIZE);
+
+  acquire(&vmaccts.lock);
+  if((a = vmacct(0)) == 0){
+    release(&vmaccts.lock);
+    kfree(pagetable);
+    return 0;
+  }
+  a->pagetable = pagetable;
+  a->rss = 0;
+  a->swap = 0;
+  a->ptpages = 1;
+  release(&vmaccts.lock);
   return pagetable;
 }
 
@@ -233,7 +538,7 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = uvmkalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
@@ -266,10 +571,11 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
   return newsz;
 }
 
-// Recursively free page-table pages.
+// Recursively free page-table pages, and take them off
+// the page table's counters, acct.
 // All leaf mappings must already have been removed.
 void
-freewalk(pagetable_t pagetable)
+freewalk(pagetable_t pagetable, struct vmacct *acct)
 {
   // there are 2^9 = 512 PTEs in a page table.
   for(int i = 0; i < 512; i++){
@@ -277,13 +583,15 @@ freewalk(pagetable_t pagetable)
     if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
       // this PTE points to a lower-level page table.
       uint64 child = PTE2PA(pte);
-      freewalk((pagetable_t)child);
+      freewalk((pagetable_t)child, acct);
       pagetable[i] = 0;
     } else if(pte & PTE_V){
       panic("freewalk: leaf");
     }
   }
   kfree((void*)pagetable);
+  if(acct)
+    __sync_fetch_and_sub(&acct->ptpages, 1);
 }
 
 // Free user memory pages,
@@ -291,47 +599,214 @@ freewalk(pagetable_t pagetable)
 void
 uvmfree(pagetable_t pagetable, uint64 sz)
 {
+  struct vmacct *a = vmacct(pagetable);
+
   if(sz > 0)
     uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
-  freewalk(pagetable);
+  freewalk(pagetable, a);
+  if(a){
+    acquire(&vmaccts.lock);
+    a->pagetable = 0;
+    release(&vmaccts.lock);
+  }
 }
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: the physical pages are
+// shared, and writable pages are marked copy-on-write
+// in both parent and child (see uvmcow()).
+// Pages the parent has not touched yet stay unmapped,
+// and will be allocated lazily in the child too.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
-  uint64 pa, i;
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Map the pages of old between va and va+len into new as
+// well, at the same addresses, sharing the physical pages.
+// If cow is set, writable pages become copy-on-write in
+// both page tables; otherwise writes go to the shared page.
+// returns 0 on success, -1 on failure.
+// unmaps any pages it mapped on failure.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 va, uint64 len, int cow)
+{
+  pte_t *pte, *npte;
+  uint64 pa, a;
   uint flags;
-  char *mem;
+  struct vmacct *acct;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+  for(a = va; a < va + len; a += PGSIZE){
+    if((pte = walk(old, a, 0)) == 0)
+      continue;
+    if(*pte & PTE_SWAP){
+      // share the swap slot; whichever reads it back in
+      // gets a private copy.
+      if((npte = walk(new, a, 1)) == 0)
+        goto err;
+      *npte = *pte;
+      swapdup(PTE2PA(*pte) / PGSIZE);
+      if((acct = vmacct(new)) != 0)
+        __sync_fetch_and_add(&acct->swap, 1);
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(cow && (*pte & PTE_W)){
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      uvmstale(old);
+    }
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, a, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (a - va) / PGSIZE, 1);
   return -1;
 }
 
+// Give the page at va a private, writable copy,
+// after a write to a copy-on-write page.
+// If no one else shares the page, just make it writable.
+// Returns 0 on success, or if the PTE changed while
+// waiting for memory, in which case the caller should look
+// at it again; -1 if va is not a copy-on-write page or if
+// out of memory.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte, old;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  if((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 || (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  uvmstale(pagetable);
+
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  // uvmkalloc() may sleep, and meanwhile the page may lose
+  // its other sharers, or be paged out.
+  old = *pte;
+  if((mem = uvmkalloc()) == 0)
+    return -1;
+  if(*pte != old){
+    kfree(mem);
+    return 0;
+  }
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Handle a page fault at user virtual address va of the
+// current process, which has page table pagetable.
+// Reads back pages that were paged out to swap, reads in
+// pages of the program that exec() left on disk,
+// allocates a zeroed page for a heap address that sbrk()
+// reserved but that has not been touched yet, reads in
+// pages of mmap()ed files, and breaks copy-on-write
+// sharing if write is set.
+// Returns the physical address of the page, or 0 if va
+// is not a valid address or if out of memory.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+
+  if(va >= MAXVA)
+    return 0;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if((*pte & PTE_U) == 0)
+      return 0;
+    if(write && (*pte & PTE_COW)){
+      if(uvmcow(pagetable, va) < 0)
+        return 0;
+      if((*pte & (PTE_V|PTE_COW)) != PTE_V)
+        return vmfault(pagetable, va, write);  // it changed; again
+    }
+    if(write && (*pte & PTE_W) == 0)
+      return 0;
+    // a fault on a good mapping means a stale TLB entry, or
+    // that swapout() cleared PTE_A on a hart that doesn't
+    // set it in hardware.
+    *pte |= PTE_A | (write ? PTE_D : 0);
+    uvmstale(pagetable);
+    return PTE2PA(*pte);
+  }
+
+  // not mapped: a page in swap, a page of the program not
+  // yet read in, a lazily-allocated heap page, or a page of
+  // a memory-mapped file?
+  if(p == 0 || pagetable != p->pagetable)
+    return 0;
+  if(pte && (*pte & PTE_SWAP))
+    return swapin(pagetable, pte);
+  // a process at its memory limit can't map more pages.
+  if(uvmoverlimit(p, 1))
+    return 0;
+  if(va >= p->sz)
+    return vmafault(p, va, write);
+  if((pa = segfault(p, va, write)) != -1)
+    return pa;
+  if((mem = uvmkalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// Fault in the user pages from va to va+len, for writing if
+// write is set, before a copy to or from them that is made
+// with an inode or buffer lock held: faulting in a page of
+// a mapped file or of the program would take those locks,
+// and could deadlock. A page paged out again meanwhile
+// comes back from swap, which takes none of them.
+// Stops at the first page that can't be faulted in, where
+// the copy will fail.
+void
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len, int write)
+{
+  uint64 a;
+  pte_t *pte;
+
+  for(a = PGROUNDDOWN(va); a < va + len && a < MAXVA; a += PGSIZE){
+    pte = walk(pagetable, a, 0);
+    if(pte && (*pte & PTE_V) && (!write || (*pte & PTE_COW) == 0))
+      continue;
+    if(vmfault(pagetable, a, write) == 0)
+      return;
+  }
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -345,6 +820,64 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Return the leaf PTE that maps user page va in pagetable,
+// or 0 if there is none. The current process remembers where
+// it found recent pages' PTEs in p->ucache, so that copies
+// spanning many pages don't walk the page table for each one.
+// The cache holds PTE addresses rather than their contents, so
+// it stays right as PTEs change and pages are unmapped; it is
+// only cleared when the page table itself is replaced.
+static pte_t *
+uvmpte(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  struct ucache *c = 0;
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  if(p && p->pagetable == pagetable){
+    c = &p->ucache[(va / PGSIZE) % NUCACHE];
+    if(c->pte && c->va == va)
+      return (*c->pte & PTE_V) ? c->pte : 0;
+  }
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+    return 0;
+  if(c && PTE_LEAF(*pte)){
+    c->va = va;
+    c->pte = pte;
+  }
+  return pte;
+}
+
+#ifdef KERNMAP
+// copyout(), copyin() and copyinstr() can reach user memory
+// directly when pagetable is the current process's, since
+// the kernel runs on it. Return the end of the range of
+// user addresses that holds va, or 0 if that isn't possible.
+// Addresses outside the ranges go the slow way, so a user
+// pointer into the kernel fails as usual. So does the stack
+// guard page: it lacks only PTE_U, which doesn't stop the
+// kernel.
+static uint64
+uaccesslimit(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || pagetable != p->pagetable)
+    return 0;
+  if(p->guard && va < p->guard)
+    return p->guard;
+  if(p->guard && va < p->guard + PGSIZE)
+    return 0;
+  if(va < HEAPTOP)
+    return HEAPTOP;
+  if(va >= MMAPBASE && va < MMAPTOP)
+    return MMAPTOP;
+  return 0;
+}
+#endif
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -352,12 +885,36 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
+
+#ifdef KERNMAP
+  uint64 lim;
+  int r;
+
+  if((lim = uaccesslimit(pagetable, dstva)) != 0 && len <= lim - dstva){
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
+    r = uaccess_copy((void*)dstva, src, len);
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+    return r;
+  }
+#endif
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
+      return -1;
+    pte = uvmpte(pagetable, va0);
+    if(pte == 0 || (*pte & PTE_COW)){
+      if(vmfault(pagetable, va0, 1) == 0)
+        return -1;
+      pte = uvmpte(pagetable, va0);
+    }
+    if(pte == 0 || (*pte & (PTE_U|PTE_W)) != (PTE_U|PTE_W))
       return -1;
+    // as if user code had stored to the page, so that
+    // a MAP_SHARED page gets written back to its file.
+    *pte |= PTE_A | PTE_D;
+    pa0 = PTE2PA(*pte);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -377,12 +934,28 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  pte_t *pte;
+
+#ifdef KERNMAP
+  uint64 lim;
+  int r;
+
+  if((lim = uaccesslimit(pagetable, srcva)) != 0 && len <= lim - srcva){
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
+    r = uaccess_copy(dst, (void*)srcva, len);
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+    return r;
+  }
+#endif
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    pte = uvmpte(pagetable, va0);
+    if(pte == 0 && vmfault(pagetable, va0, 0) != 0)
+      pte = uvmpte(pagetable, va0);
+    if(pte == 0 || (*pte & PTE_U) == 0)
       return -1;
+    pa0 = PTE2PA(*pte);
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
@@ -402,20 +975,51 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
+  uint64 n, va0, pa0, w;
+  pte_t *pte;
   int got_null = 0;
 
+#ifdef KERNMAP
+  uint64 lim;
+  int r;
+
+  if((lim = uaccesslimit(pagetable, srcva)) != 0){
+    if(max > lim - srcva)
+      max = lim - srcva;
+    w_sstatus(r_sstatus() | SSTATUS_SUM);
+    r = uaccess_copystr(dst, (char*)srcva, max);
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+    return r;
+  }
+#endif
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    pte = uvmpte(pagetable, va0);
+    if(pte == 0 && vmfault(pagetable, va0, 0) != 0)
+      pte = uvmpte(pagetable, va0);
+    if(pte == 0 || (*pte & PTE_U) == 0)
       return -1;
+    pa0 = PTE2PA(*pte);
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
     char *p = (char *) (pa0 + (srcva - va0));
     while(n > 0){
+      // a word at a time while both sides are aligned
+      // and the word has no zero byte in it.
+      if(n >= 8 && (((uint64)p | (uint64)dst) & 7) == 0){
+        w = *(uint64*)p;
+        if(((w - 0x0101010101010101L) & ~w & 0x8080808080808080L) == 0){
+          *(uint64*)dst = w;
+          n -= 8;
+          max -= 8;
+          p += 8;
+          dst += 8;
+          continue;
+        }
+      }
       if(*p == '\0'){
         *dst = '\0';
         got_null = 1;
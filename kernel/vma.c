@@ -0,0 +1,287 @@
+//
+// Memory-mapped files.
+//
+// mmap() records a region of the process's address space
+// in p->vma[] without mapping any pages. The first touch of
+// a page faults into vmafault(), which reads that page of the
+// file into a fresh physical page. MAP_SHARED regions write
+// their dirty pages back to the file when they are unmapped,
+// either by munmap() or when the process exits or execs.
+//
+// Regions are placed below MMAPTOP, each one directly under
+// the lowest existing region, and the heap may not grow
+// into them. Shared memory segments attached by shmat()
+// are regions with no file (see shm.c).
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "fs.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "proc.h"
+#include "fcntl.h"
+
+// Return the lowest address used by any mapped region,
+// which is the limit for the heap.
+uint64
+vmabase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = MMAPTOP;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && v->addr < base)
+      base = v->addr;
+  }
+  return base;
+}
+
+// Return the region of p containing va, or 0.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len > 0 && va >= v->addr && va < v->addr + v->len)
+      return v;
+  }
+  return 0;
+}
+
+// Reserve a region of len bytes in p's address space,
+// directly below its lowest region. f, if not 0, is
+// the file to map and gets a new reference.
+// Returns the region, or 0 if there is no room.
+struct vma*
+vmaalloc(struct proc *p, uint64 len, int prot, int flags, struct file *f, uint64 off)
+{
+  struct vma *v;
+  uint64 addr;
+
+  len = PGROUNDUP(len);
+  addr = vmabase(p);
+  if(len == 0 || addr < len || addr - len < PGROUNDUP(p->sz) || addr - len < MMAPBASE)
+    return 0;
+  addr -= len;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0){
+      v->addr = addr;
+      v->len = len;
+      v->prot = prot;
+      v->flags = flags;
+      v->f = f ? filedup(f) : 0;
+      v->off = off;
+      return v;
+    }
+  }
+  return 0;
+}
+
+// Map len bytes of file f, starting at offset off, into the
+// current process. Returns the address of the region,
+// or -1 on error.
+uint64
+mmap(struct file *f, uint64 len, int prot, int flags, uint64 off)
+{
+  struct vma *v;
+
+  if(len == 0 || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+
+  if((v = vmaalloc(myproc(), len, prot, flags, f, off)) == 0)
+    return -1;
+  return v->addr;
+}
+
+// Read the page of the file that backs va into memory,
+// after a page fault on an address above the heap.
+// Returns the physical address of the new page, or 0 if
+// va is not in a mapped region, the access isn't allowed,
+// or if out of memory.
+uint64
+vmafault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  char *mem;
+  int perm;
+
+  va = PGROUNDDOWN(va);
+  if((v = vmalookup(p, va)) == 0 || v->f == 0)
+    return 0;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return 0;
+  if(!write && (v->prot & (PROT_READ|PROT_EXEC)) == 0)
+    return 0;
+
+  if((mem = uvmkalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  ilock(v->f->ip);
+  readi(v->f->ip, 0, (uint64)mem, v->off + (va - v->addr), PGSIZE);
+  iunlock(v->f->ip);
+
+  perm = PTE_U;
+  if(v->prot & (PROT_READ|PROT_WRITE))
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// Write the dirty pages of a MAP_SHARED region between
+// addr and addr+len back to the file.
+// Writes that would extend the file are dropped.
+static void
+vmawriteback(struct proc *p, struct vma *v, uint64 addr, uint64 len)
+{
+  // as in filewrite(), write a few blocks per transaction.
+  int max = ((MAXOPBLOCKS-1-4-2) / 2) * BSIZE;
+  struct inode *ip;
+  uint64 a, pa;
+  uint off, n, n1, i;
+  pte_t *pte;
+
+  if(v->f == 0 || v->flags != MAP_SHARED || (v->prot & PROT_WRITE) == 0)
+    return;
+  ip = v->f->ip;
+
+  for(a = addr; a < addr + len; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0)
+      continue;
+    if((*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    pa = PTE2PA(*pte);
+    off = v->off + (a - v->addr);
+    for(i = 0; i < PGSIZE; i += n1){
+      begin_op();
+      ilock(ip);
+      n = 0;
+      if(off + i < ip->size)
+        n = ip->size - (off + i);
+      n1 = PGSIZE - i;
+      if(n1 > max)
+        n1 = max;
+      if(n > n1)
+        n = n1;
+      if(n > 0)
+        writei(ip, 0, pa + i, off + i, n);
+      iunlock(ip);
+      end_op();
+    }
+  }
+}
+
+// Unmap len bytes at addr from the current process.
+// The range must lie within a single region and include
+// either its start or its end. Returns 0 or -1.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if((v = vmalookup(p, addr)) == 0)
+    return -1;
+  if(addr + len > v->addr + v->len)
+    return -1;
+  if(addr != v->addr && addr + len != v->addr + v->len)
+    return -1;
+
+  vmawriteback(p, v, addr, len);
+  uvmunmap(p->pagetable, addr, len / PGSIZE, 1);
+
+  if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0 && v->f){
+    fileclose(v->f);
+    v->f = 0;
+  }
+  return 0;
+}
+
+// Unmap all of p's regions, writing back shared ones.
+// Called by exit() and exec(), and to undo a failed fork.
+void
+vmaclose(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    vmawriteback(p, v, v->addr, v->len);
+    uvmunmap(p->pagetable, v->addr, v->len / PGSIZE, 1);
+    if(v->f)
+      fileclose(v->f);
+    v->f = 0;
+    v->len = 0;
+  }
+}
+
+// Undo a failed vmacopy() into np: unmap the regions it
+// copied and close their files, but write nothing back,
+// since the pages are still the parent's. May sleep, so
+// the caller must not hold np->lock.
+void
+vmadrop(struct proc *np)
+{
+  struct vma *v;
+
+  for(v = np->vma; v < &np->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    uvmunmap(np->pagetable, v->addr, v->len / PGSIZE, 1);
+    if(v->f)
+      fileclose(v->f);
+    v->f = 0;
+    v->len = 0;
+  }
+}
+
+// Give the child np the same regions as p.
+// Pages already faulted in are shared: MAP_SHARED pages
+// stay writable in both, MAP_PRIVATE pages become
+// copy-on-write. Returns 0 on success, -1 on failure, after
+// which the caller must undo it with vmadrop().
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(v->len == 0)
+      continue;
+    if(uvmshare(p->pagetable, np->pagetable, v->addr, v->len,
+                v->flags == MAP_PRIVATE) < 0)
+      return -1;
+    *nv = *v;
+    if(nv->f)
+      filedup(nv->f);
+  }
+  return 0;
+}
@@ -0,0 +1,283 @@
+//
+// Compressed in-memory store for swapped-out pages.
+//
+// swapout() offers each page it evicts to zstore() before
+// writing it to the disk. A page that compresses to at most
+// ZMAX bytes is kept here instead, in slabs: pages from
+// kalloc() divided into ZCHUNK-byte chunks, of which each
+// compressed page takes a contiguous run. A page of zeroes,
+// the commonest kind of cold page, takes no space at all.
+// swapin() gets the page back with zload().
+//
+// The store is indexed by swap slot, so PTEs and fork()
+// don't need to know where a swapped-out page is.
+//
+// Pages are compressed with a small LZ77 coder in the
+// style of LZ4: a sequence of literal bytes followed by a
+// copy of earlier output, over and over.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+
+#define ZCHUNK    64                  // bytes per slab chunk
+#define ZMAX      (PGSIZE*3/4)        // largest compressed page kept
+#define ZHASHBITS 10
+
+struct zslab {
+  uchar *mem;       // 0 if the slab is not in use
+  uint64 used;      // bitmap of chunks in use
+};
+
+struct zent {
+  uchar stored;     // slot's page is here
+  ushort slab;
+  uchar chunk;      // first chunk in slab
+  ushort len;       // compressed length; 0 for a page of zeroes
+};
+
+struct {
+  struct spinlock lock;
+  struct zslab slab[NZSLAB];
+  struct zent ent[NSWAP];
+  uchar buf[ZMAX];              // compressor output
+  ushort hash[1 << ZHASHBITS];  // compressor match finder
+} zram;
+
+void
+zraminit(void)
+{
+  initlock(&zram.lock, "zram");
+}
+
+// Append one sequence to the compressed output at op: nlit
+// bytes from lit, then, unless mlen is 0, a copy of mlen
+// bytes from off bytes back. Returns the new end of the
+// output, or 0 if it would pass oend.
+static uchar*
+lzemit(uchar *op, uchar *oend, uchar *lit, int nlit, int off, int mlen)
+{
+  uchar *token;
+  int n;
+
+  if(op + 1 + nlit/255 + 1 + nlit + 2 + mlen/255 + 1 > oend)
+    return 0;
+  token = op++;
+  *token = (nlit < 15 ? nlit : 15) << 4;
+  if(nlit >= 15){
+    for(n = nlit - 15; n >= 255; n -= 255)
+      *op++ = 255;
+    *op++ = n;
+  }
+  memmove(op, lit, nlit);
+  op += nlit;
+  if(mlen == 0)
+    return op;
+
+  *op++ = off;
+  *op++ = off >> 8;
+  n = mlen - 4;
+  *token |= (n < 15 ? n : 15);
+  if(n >= 15){
+    for(n -= 15; n >= 255; n -= 255)
+      *op++ = 255;
+    *op++ = n;
+  }
+  return op;
+}
+
+// Compress the page at src into dst.
+// Returns the compressed length, or -1 if it is over max.
+static int
+lzcompress(uchar *src, uchar *dst, int max)
+{
+  uchar *ip, *anchor, *ref, *op;
+  uchar *end = src + PGSIZE;
+  uint v, h;
+  int len;
+
+  memset(zram.hash, 0, sizeof(zram.hash));
+  op = dst;
+  anchor = src;
+  for(ip = src; ip + 4 <= end; ){
+    v = ip[0] | ip[1] << 8 | ip[2] << 16 | (uint)ip[3] << 24;
+    h = (v * 2654435761U) >> (32 - ZHASHBITS);
+    ref = src + zram.hash[h];
+    zram.hash[h] = ip - src;
+    if(ref >= ip || ref[0] != ip[0] || ref[1] != ip[1] ||
+       ref[2] != ip[2] || ref[3] != ip[3]){
+      ip++;
+      continue;
+    }
+    for(len = 4; ip + len < end && ip[len] == ref[len]; len++)
+      ;
+    if((op = lzemit(op, dst + max, anchor, ip - anchor, ip - ref, len)) == 0)
+      return -1;
+    ip += len;
+    anchor = ip;
+  }
+  if((op = lzemit(op, dst + max, anchor, end - anchor, 0, 0)) == 0)
+    return -1;
+  return op - dst;
+}
+
+// Decompress n bytes at src into the page at dst.
+static void
+lzdecompress(uchar *src, int n, uchar *dst)
+{
+  uchar *ip = src, *iend = src + n, *op = dst, *ref;
+  int t, len;
+
+  while(ip < iend){
+    t = *ip++;
+    if((len = t >> 4) == 15){
+      do
+        len += *ip;
+      while(*ip++ == 255);
+    }
+    memmove(op, ip, len);
+    op += len;
+    ip += len;
+    if(ip >= iend)
+      break;
+
+    ref = op - (ip[0] | ip[1] << 8);
+    ip += 2;
+    if((len = t & 15) == 15){
+      do
+        len += *ip;
+      while(*ip++ == 255);
+    }
+    // byte by byte, since the copy may overlap its source.
+    for(len += 4; len > 0; len--)
+      *op++ = *ref++;
+  }
+  if(op != dst + PGSIZE)
+    panic("lzdecompress");
+}
+
+// Find n free chunks in a row in slab s.
+// Returns the first, or -1.
+static int
+chunkfind(struct zslab *s, int n)
+{
+  uint64 mask = (n == 64) ? ~0L : (1L << n) - 1;
+  int i;
+
+  for(i = 0; i + n <= PGSIZE/ZCHUNK; i++)
+    if((s->used & (mask << i)) == 0)
+      return i;
+  return -1;
+}
+
+// Keep a compressed copy of the page at pa as slot's.
+// If there is no room in the slabs and no memory for a new
+// one, pa itself becomes a slab, since the caller is about
+// to give it up anyway.
+// Returns 0 if the page was stored, 1 if it was stored and
+// pa is now a slab, or -1 if it doesn't compress well or
+// the store is full.
+int
+zstore(int slot, uint64 pa)
+{
+  struct zent *e = &zram.ent[slot];
+  struct zslab *s;
+  uint64 *w;
+  int len, n, i, c, r;
+
+  for(w = (uint64*)pa; w < (uint64*)(pa + PGSIZE); w++)
+    if(*w != 0)
+      break;
+
+  acquire(&zram.lock);
+  if(w == (uint64*)(pa + PGSIZE)){
+    e->stored = 1;
+    e->len = 0;
+    release(&zram.lock);
+    return 0;
+  }
+  if((len = lzcompress((uchar*)pa, zram.buf, ZMAX)) < 0){
+    release(&zram.lock);
+    return -1;
+  }
+
+  n = (len + ZCHUNK - 1) / ZCHUNK;
+  c = -1;
+  for(i = 0; i < NZSLAB; i++){
+    s = &zram.slab[i];
+    if(s->mem && (c = chunkfind(s, n)) >= 0)
+      break;
+  }
+  r = 0;
+  if(c < 0){
+    for(i = 0; i < NZSLAB; i++)
+      if(zram.slab[i].mem == 0)
+        break;
+    if(i == NZSLAB){
+      release(&zram.lock);
+      return -1;
+    }
+    s = &zram.slab[i];
+    if((s->mem = kalloc()) == 0){
+      s->mem = (uchar*)pa;
+      r = 1;
+    }
+    s->used = 0;
+    c = 0;
+  }
+
+  s->used |= ((n == 64) ? ~0L : (1L << n) - 1) << c;
+  memmove(s->mem + c*ZCHUNK, zram.buf, len);
+  e->stored = 1;
+  e->slab = i;
+  e->chunk = c;
+  e->len = len;
+  release(&zram.lock);
+  return r;
+}
+
+// Decompress slot's page into the page at pa.
+// Returns 0, or -1 if slot's page isn't stored here.
+int
+zload(int slot, uint64 pa)
+{
+  struct zent *e = &zram.ent[slot];
+
+  acquire(&zram.lock);
+  if(!e->stored){
+    release(&zram.lock);
+    return -1;
+  }
+  if(e->len == 0)
+    memset((void*)pa, 0, PGSIZE);
+  else
+    lzdecompress(zram.slab[e->slab].mem + e->chunk*ZCHUNK, e->len, (uchar*)pa);
+  release(&zram.lock);
+  return 0;
+}
+
+// Drop slot's page, if it is stored here, and give back
+// its slab once nothing else is in it.
+void
+zfree(int slot)
+{
+  struct zent *e = &zram.ent[slot];
+  struct zslab *s;
+  int n;
+
+  acquire(&zram.lock);
+  if(e->stored && e->len > 0){
+    s = &zram.slab[e->slab];
+    n = (e->len + ZCHUNK - 1) / ZCHUNK;
+    s->used &= ~(((n == 64) ? ~0L : (1L << n) - 1) << e->chunk);
+    if(s->used == 0){
+      kfree(s->mem);
+      s->mem = 0;
+    }
+  }
+  e->stored = 0;
+  release(&zram.lock);
+}
@@ -1,6 +1,7 @@
 #include "kernel/types.h"
 
 struct stat;
+struct memstat;
 
 // system calls
 int fork(void);
@@ -32,6 +33,16 @@ int settickets(int);       // Added syscall to set tickets for currently running
 int waitx(int*, int* /*wtime*/, int* /*rtime*/);// Added waitx syscall given in TUT .
 int set_priority(int, int);// Added syscall to set priority
 /////////////////////////////
+void* mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int shmget(int, uint64);
+void* shmat(int);
+int shmdt(void*);
+int shmrm(int);
+int memstat(int, struct memstat*);
+int memlimit(int);
+int fsync(int);
+int fallocate(int, uint64);
 
 // ulib.c
 int stat(const char*, struct stat*);
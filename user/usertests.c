@@ -1,6 +1,7 @@
 #include "kernel/param.h"
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/memstat.h"
 #include "user/user.h"
 #include "kernel/fs.h"
 #include "kernel/fcntl.h"
@@ -32,9 +33,11 @@ char buf[BUFSZ];
 void
 copyin(char *s)
 {
-  uint64 addrs[] = { 0x80000000LL, 0xffffffffffffffff };
+  // the last is the stack guard page, below the stack page.
+  uint64 addrs[] = { 0x80000000LL, 0xffffffffffffffff,
+                     (r_sp() & ~(PGSIZE-1)) - PGSIZE };
 
-  for(int ai = 0; ai < 2; ai++){
+  for(int ai = 0; ai < 3; ai++){
     uint64 addr = addrs[ai];
     
     int fd = open("copyin1", O_CREATE|O_WRONLY);
@@ -76,9 +79,11 @@ copyin(char *s)
 void
 copyout(char *s)
 {
-  uint64 addrs[] = { 0x80000000LL, 0xffffffffffffffff };
+  // the last is the stack guard page, below the stack page.
+  uint64 addrs[] = { 0x80000000LL, 0xffffffffffffffff,
+                     (r_sp() & ~(PGSIZE-1)) - PGSIZE };
 
-  for(int ai = 0; ai < 2; ai++){
+  for(int ai = 0; ai < 3; ai++){
     uint64 addr = addrs[ai];
 
     int fd = open("README", 0);
@@ -575,9 +580,12 @@ writetest(char *s)
   }
 }
 
+// a file bigger than MAXFILE blocks, which only a file
+// mapped by extents can be.
 void
 writebig(char *s)
 {
+  enum { N = NDIRECT + NINDIRECT + 300 };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -586,7 +594,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < N; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -606,7 +614,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != N){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -629,6 +637,105 @@ writebig(char *s)
   }
 }
 
+// write two files a block at a time, in turn, so that their
+// blocks alternate on disk and each needs many extents.
+void
+extentfrag(char *s)
+{
+  enum { N = 300 };
+  int fd[2], i, j;
+
+  for(j = 0; j < 2; j++){
+    fd[j] = open(j ? "frag1" : "frag0", O_CREATE|O_RDWR|O_TRUNC);
+    if(fd[j] < 0){
+      printf("%s: create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    for(j = 0; j < 2; j++){
+      ((int*)buf)[0] = i;
+      ((int*)buf)[1] = j;
+      if(write(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: write failed\n", s);
+        exit(1);
+      }
+    }
+  }
+  for(j = 0; j < 2; j++){
+    close(fd[j]);
+    fd[j] = open(j ? "frag1" : "frag0", O_RDONLY);
+    for(i = 0; i < N; i++){
+      if(read(fd[j], buf, BSIZE) != BSIZE ||
+         ((int*)buf)[0] != i || ((int*)buf)[1] != j){
+        printf("%s: wrong content in block %d\n", s, i);
+        exit(1);
+      }
+    }
+    close(fd[j]);
+  }
+  unlink("frag0");
+  unlink("frag1");
+}
+
+// blocks allocated ahead by fallocate() don't change the
+// file's size, and hold what is later written to them.
+void
+fallocatetest(char *s)
+{
+  enum { N = 100 };
+  struct stat st;
+  int fd, i;
+
+  fd = open("falloc", O_CREATE|O_RDWR|O_TRUNC);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(fallocate(fd, N*BSIZE) != 0){
+    printf("%s: fallocate failed\n", s);
+    exit(1);
+  }
+  if(fstat(fd, &st) < 0 || st.size != 0){
+    printf("%s: fallocate changed the size\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    ((int*)buf)[0] = i;
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  // more than the disk holds fails up front.
+  if(fallocate(fd, 0xf0000000UL) != -1){
+    printf("%s: fallocate past the disk's size succeeded\n", s);
+    exit(1);
+  }
+  if(fstat(fd, &st) < 0 || st.size != N*BSIZE){
+    printf("%s: failed fallocate changed the size\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(fallocate(fd, BSIZE) != -1){
+    printf("%s: fallocate on a closed fd succeeded\n", s);
+    exit(1);
+  }
+  fd = open("falloc", O_RDONLY);
+  if(fallocate(fd, BSIZE) != -1){
+    printf("%s: fallocate on a read-only fd succeeded\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, BSIZE) != BSIZE || ((int*)buf)[0] != i){
+      printf("%s: wrong content in block %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("falloc");
+}
+
 // many creates, followed by unlink test
 void
 createtest(char *s)
@@ -897,6 +1004,24 @@ exitwait(char *s)
       exit(i);
     }
   }
+
+  // a bad status pointer must not reap the child.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(7);
+  if(wait((int*)0xffffffffffL) != -1){
+    printf("%s: wait with a bad pointer succeeded\n", s);
+    exit(1);
+  }
+  int xstate;
+  if(wait(&xstate) != pid || xstate != 7){
+    printf("%s: child lost after a bad wait\n", s);
+    exit(1);
+  }
 }
 
 // try to find races in the reparenting
@@ -1993,6 +2118,57 @@ forktest(char *s)
   }
 }
 
+// fork a process whose memory is more than half of
+// physical memory. only works if fork shares pages
+// copy-on-write instead of copying them.
+void
+cowfork(char *s)
+{
+  enum { BIG=80*1024*1024 };
+  char *a, *b;
+  int pid, xstatus;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(b = a; b < a+BIG; b += PGSIZE)
+    *(int*)b = getpid();
+
+  for(int i = 0; i < 3; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      // write a few pages; each write takes a private copy.
+      for(b = a; b < a+BIG; b += 64*PGSIZE)
+        *(int*)b = getpid();
+      for(b = a; b < a+BIG; b += 64*PGSIZE){
+        if(*(int*)b != getpid()){
+          printf("%s: child sees wrong value\n", s);
+          exit(1);
+        }
+      }
+      exit(0);
+    }
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+
+  // the children's writes must not be visible to the parent.
+  for(b = a; b < a+BIG; b += PGSIZE){
+    if(*(int*)b != getpid()){
+      printf("%s: parent sees child's write\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-BIG);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2117,6 +2293,351 @@ sbrkmuch(char *s)
   }
 }
 
+// memstat() should count pages as they are touched, and
+// memlimit() should make sbrk() fail beyond the limit, and
+// not let the process raise it.
+void
+memaccount(char *s)
+{
+  struct memstat st0, st1;
+  char *a;
+  int i, limit;
+
+  if(memstat(0, &st0) < 0){
+    printf("%s: memstat failed\n", s);
+    exit(1);
+  }
+  a = sbrk(10*PGSIZE);
+  for(i = 0; i < 10; i++)
+    a[i*PGSIZE] = 1;
+  if(memstat(getpid(), &st1) < 0 || st1.rss != st0.rss + 10 ||
+     st1.ptpages < 3 || st1.kpages < 1){
+    printf("%s: memstat rss %d, expected %d\n", s, st1.rss, st0.rss + 10);
+    exit(1);
+  }
+  if(memstat(-1, &st1) != -1){
+    printf("%s: memstat of a bad pid succeeded\n", s);
+    exit(1);
+  }
+
+  limit = (uint64)sbrk(0)/PGSIZE + 16;
+  memlimit(limit);
+  if(memlimit(limit + 1) != -1 || memlimit(0) != -1){
+    printf("%s: raising the memory limit succeeded\n", s);
+    exit(1);
+  }
+  if(sbrk(1024*PGSIZE) != (char*)0xffffffffffffffffL){
+    printf("%s: sbrk past the memory limit succeeded\n", s);
+    exit(1);
+  }
+  if(sbrk(PGSIZE) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk within the memory limit failed\n", s);
+    exit(1);
+  }
+}
+
+// fsync() of a file, then read it back.
+void
+fsyncfile(char *s)
+{
+  char buf[64];
+  int fd, i;
+
+  unlink("fsyncfile");
+  fd = open("fsyncfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 20; i++){
+    memset(buf, 'a'+i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+    if(i % 5 == 0 && fsync(fd) != 0){
+      printf("%s: fsync failed\n", s);
+      exit(1);
+    }
+  }
+  if(fsync(fd) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(fsync(fd) != -1){
+    printf("%s: fsync of a closed fd succeeded\n", s);
+    exit(1);
+  }
+
+  fd = open("fsyncfile", O_RDONLY);
+  for(i = 0; i < 20; i++){
+    if(read(fd, buf, sizeof(buf)) != sizeof(buf) || buf[0] != 'a'+i ||
+       buf[sizeof(buf)-1] != 'a'+i){
+      printf("%s: wrong data after fsync\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("fsyncfile");
+}
+
+// fill pages with identical contents and sleep, so that the
+// kernel can merge them, then make sure writes to them still
+// go to separate pages.
+void
+ksmcow(char *s)
+{
+  enum { N=64 };
+  char *a;
+  int i, j;
+
+  a = sbrk(N*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    memset(a + i*PGSIZE, 'k', PGSIZE);
+  sleep(10);
+  for(i = 0; i < N; i++)
+    a[i*PGSIZE + i] = i;
+  for(i = 0; i < N; i++){
+    for(j = 0; j < PGSIZE; j++){
+      if(a[i*PGSIZE + j] != (j == i ? i : 'k')){
+        printf("%s: merged page %d changed\n", s, i);
+        exit(1);
+      }
+    }
+  }
+}
+
+// sbrk only reserves address space; pages are allocated
+// and zeroed when first touched.
+void
+sbrklazy(char *s)
+{
+  enum { HUGE=1024*1024*1024 };  // far more than physical memory
+  char *a, *b;
+
+  a = sbrk(HUGE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: lazy sbrk failed\n", s);
+    exit(1);
+  }
+  for(b = a; b < a+HUGE; b += HUGE/16){
+    if(*b != 0){
+      printf("%s: lazily allocated page not zero\n", s);
+      exit(1);
+    }
+    *b = 1;
+  }
+  *(a+HUGE-1) = 1;
+
+  // a system call should be able to fill untouched pages too.
+  int fds[2];
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  b = a + HUGE/2 + 7*PGSIZE;
+  write(fds[1], "x", 1);
+  if(read(fds[0], b, 1) != 1 || *b != 'x'){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  if(sbrk(-HUGE) != a+HUGE){
+    printf("%s: sbrk could not deallocate\n", s);
+    exit(1);
+  }
+}
+
+// map a file into memory, read it through the mapping,
+// and write it back through a MAP_SHARED mapping.
+void
+mmaptest(char *s)
+{
+  enum { N = 2*PGSIZE + PGSIZE/2 };
+  char *a, *b;
+  int fd, i, pid, xstatus;
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create mmapfile failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    buf[i] = 'a' + i % 26;
+  if(write(fd, buf, N) != N){
+    printf("%s: write mmapfile failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDWR);
+  a = mmap(0, 3*PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3*PGSIZE; i++){
+    if(a[i] != (i < N ? 'a' + i % 26 : 0)){
+      printf("%s: wrong byte %d in mapping\n", s, i);
+      exit(1);
+    }
+  }
+  if(munmap(a, 3*PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  // writes through a shared mapping reach the file, including
+  // writes made by a forked child.
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  a[0] = 'X';
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(a[0] != 'X')
+      exit(1);
+    a[PGSIZE] = 'Y';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child could not use mapping\n", s);
+    exit(1);
+  }
+  if(munmap(a, N) != 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, N) != N || buf[0] != 'X' || buf[PGSIZE] != 'Y'){
+    printf("%s: shared writes not in file\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // read() into, and write() from, mappings of the same file
+  // that aren't faulted in yet.
+  fd = open("mmapfile", O_RDWR);
+  a = mmap(0, N, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  b = mmap(0, N, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(a == (char*)0xffffffffffffffffL || b == (char*)0xffffffffffffffffL){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(read(fd, a, N) != N || a[0] != 'X' || a[PGSIZE] != 'Y'){
+    printf("%s: read into a mapping of the file failed\n", s);
+    exit(1);
+  }
+  if(write(fd, b, N) != N){
+    printf("%s: write from a mapping of the file failed\n", s);
+    exit(1);
+  }
+  munmap(a, N);
+  munmap(b, N);
+  close(fd);
+  unlink("mmapfile");
+}
+
+// initialized data that exec() leaves on disk until it is
+// touched.
+char lazydata[3*PGSIZE] = { 1 };
+
+// read this program's own file into pages of its data that
+// aren't loaded yet, which come from the same file.
+void
+readself(char *s)
+{
+  int fd, n;
+
+  fd = open("usertests", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open usertests failed\n", s);
+    exit(1);
+  }
+  n = read(fd, lazydata + 1, sizeof(lazydata) - 1);
+  if(n <= 0){
+    printf("%s: read into unloaded data failed\n", s);
+    exit(1);
+  }
+  if(lazydata[0] != 1){
+    printf("%s: data not loaded\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
+// two processes exchange data through a shared memory segment.
+void
+shmtest(char *s)
+{
+  enum { KEY = 4242, SZ = 3*PGSIZE };
+  char *a;
+  int id, pid, xstatus;
+
+  id = shmget(KEY, SZ);
+  if(id < 0){
+    printf("%s: shmget failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a = shmat(shmget(KEY, SZ));
+    if(a == (char*)0xffffffffffffffffL)
+      exit(1);
+    for(int i = 0; i < SZ; i++)
+      a[i] = i % 251;
+    shmdt(a);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child could not attach\n", s);
+    exit(1);
+  }
+
+  a = shmat(id);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: shmat failed\n", s);
+    exit(1);
+  }
+  // removing the key doesn't take the pages away from us.
+  if(shmrm(KEY) != 0){
+    printf("%s: shmrm failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < SZ; i++){
+    if(a[i] != (char)(i % 251)){
+      printf("%s: wrong byte %d in segment\n", s, i);
+      exit(1);
+    }
+  }
+  if(shmdt(a) != 0){
+    printf("%s: shmdt failed\n", s);
+    exit(1);
+  }
+}
+
 // can we read the kernel's memory?
 void
 kernmem(char *s)
@@ -2171,40 +2692,64 @@ void
 sbrkfail(char *s)
 {
   enum { BIG=100*1024*1024 };
-  int i, xstatus;
+  int i, xstatus, nkilled;
   int fds[2];
   char scratch;
   char *c, *a;
   int pids[10];
   int pid;
- 
-  if(pipe(fds) != 0){
-    printf("%s: pipe() failed\n", s);
-    exit(1);
-  }
+
+  // sbrk() only gives a process pages as it uses them, so the
+  // children touch every page, until memory and swap run out
+  // and they are killed. a child that gets all of its memory
+  // says so on its own pipe; a killed one closes it.
+  nkilled = 0;
   for(i = 0; i < sizeof(pids)/sizeof(pids[0]); i++){
+    if(pipe(fds) != 0){
+      printf("%s: pipe() failed\n", s);
+      exit(1);
+    }
     if((pids[i] = fork()) == 0){
-      // allocate a lot of memory
-      sbrk(BIG - (uint64)sbrk(0));
+      close(fds[0]);
+      a = sbrk(0);
+      if(sbrk(BIG - (uint64)a) != (char*)0xffffffffffffffffL)
+        for(c = a; c < (char*)BIG; c += PGSIZE)
+          *c = 1;
       write(fds[1], "x", 1);
       // sit around until killed
       for(;;) sleep(1000);
     }
-    if(pids[i] != -1)
-      read(fds[0], &scratch, 1);
+    close(fds[1]);
+    if(pids[i] != -1 && read(fds[0], &scratch, 1) != 1)
+      nkilled++;
+    close(fds[0]);
   }
 
-  // if those failed allocations freed up the pages they did allocate,
-  // we'll be able to allocate here
-  c = sbrk(PGSIZE);
+  // if the killed children freed the pages they did get, a new
+  // process can allocate here while the others keep theirs.
+  pid = fork();
+  if(pid == 0){
+    c = sbrk(PGSIZE);
+    if(c == (char*)0xffffffffffffffffL)
+      exit(1);
+    *c = 1;
+    exit(0);
+  }
+  xstatus = 1;
+  if(pid > 0)
+    wait(&xstatus);
   for(i = 0; i < sizeof(pids)/sizeof(pids[0]); i++){
     if(pids[i] == -1)
       continue;
     kill(pids[i]);
     wait(0);
   }
-  if(c == (char*)0xffffffffffffffffL){
-    printf("%s: failed sbrk leaked memory\n", s);
+  if(nkilled == 0){
+    printf("%s: children never ran out of memory\n", s);
+    exit(1);
+  }
+  if(xstatus != 0){
+    printf("%s: killed children leaked memory\n", s);
     exit(1);
   }
 
@@ -2590,6 +3135,8 @@ struct test {
   {opentest, "opentest"},
   {writetest, "writetest"},
   {writebig, "writebig"},
+  {extentfrag, "extentfrag"},
+  {fallocatetest, "fallocatetest"},
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
@@ -2618,8 +3165,16 @@ struct test {
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {cowfork, "cowfork"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
+  {sbrklazy, "sbrklazy"},
+  {ksmcow, "ksmcow"},
+  {memaccount, "memaccount"},
+  {fsyncfile, "fsyncfile"},
+  {mmaptest, "mmaptest"},
+  {readself, "readself"},
+  {shmtest, "shmtest"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
   {sbrkfail, "sbrkfail"},
@@ -2924,6 +3479,30 @@ outofinodes(char *s)
   }
 }
 
+// use more memory than the machine has, so that some of
+// it must be paged out to swap and read back in.
+void
+swapmuch(char *s)
+{
+  enum { BIG=136*1024*1024 };  // qemu has 128 MB, and 32 MB of swap
+  char *a;
+  uint64 i;
+
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < BIG; i += PGSIZE)
+    *(uint64*)(a + i) = i;
+  for(i = 0; i < BIG; i += PGSIZE){
+    if(*(uint64*)(a + i) != i){
+      printf("%s: page at %p changed while in swap\n", s, a + i);
+      exit(1);
+    }
+  }
+}
+
 struct test slowtests[] = {
   {bigdir, "bigdir"},
   {manywrites, "manywrites"},
@@ -2931,6 +3510,7 @@ struct test slowtests[] = {
   {execout, "execout"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
+  {swapmuch, "swapmuch"},
     
   { 0, 0},
 };
@@ -41,4 +41,14 @@ entry("sigalarm");
 entry("sigreturn");
 entry("set_priority");
 entry("settickets");
-entry("waitx");
\ No newline at end of file
+entry("waitx");
+entry("mmap");
+entry("munmap");
+entry("shmget");
+entry("shmat");
+entry("shmdt");
+entry("shmrm");
+entry("memstat");
+entry("memlimit");
+entry("fsync");
+entry("fallocate");
\ No newline at end of file